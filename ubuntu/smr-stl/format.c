@@ -6,9 +6,14 @@
 #include <stdint.h>
 #include <getopt.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "stl.h"
 #include "stl_fakesmr.h"
+#include "stl_crc.h"
 
 struct option opts[] = {
     {.name = "group-bands",       required_argument, 0, 'g'},
@@ -21,6 +26,21 @@ int group_bands = 0;
 double over_provisioning = 0.0;
 int map_bands = 0;
 
+/* a different nonce each time, so headers left over from before the
+ * format don't checksum correctly
+ */
+static uint32_t new_nonce(void)
+{
+    uint32_t nonce = time(NULL) ^ (getpid() << 16);
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &nonce, sizeof(nonce)) != sizeof(nonce))
+            nonce ^= clock();
+        close(fd);
+    }
+    return nonce;
+}
+
 void usage(char *cmd)
 {
     int i;
@@ -78,7 +98,9 @@ int main(int argc, char **argv)
     struct superblock sb = {
         .magic = STL_MAGIC, .disk_size = n_bands * band_size,
         .n_bands = n_bands, .band_size = band_size, .group_size = group_bands,
-        .group_span = group_span, .n_groups = n_groups, .map_size = map_bands};
+        .group_span = group_span, .n_groups = n_groups, .map_size = map_bands,
+        .nonce = new_nonce()};
+    sb.crc = crc32c(0, &sb, offsetof(struct superblock, crc));
     void *buf = valloc(4096);
     memcpy(buf, &sb, sizeof(sb));
 
@@ -102,12 +124,14 @@ int main(int argc, char **argv)
     struct header h1 = {
         .magic = STL_MAGIC, .seq = 0, .type = RECORD_BAND, .local_records = 0,
         .records = n_bands, .next = mkpba(1, next_offset), .prev = mkpba(1, 0),
-        .base = mkpba(1, 0)};
+        .base = mkpba(1, 0), .data_crc = crc32c(sb.nonce, bands, sectors*4096)};
+    hdr_seal(sb.nonce, &h1);
 
     struct header h2 = {
         .magic = STL_MAGIC, .seq = 1, .type = RECORD_BAND, .local_records = 0,
         .records = 0, .next = mkpba(1, next_offset+1), .prev = mkpba(1, 0),
         .base = mkpba(1, 0)};
+    hdr_seal(sb.nonce, &h2);
 
     memset(buf, 0, 4096);
     memcpy(buf, &h1, sizeof(h1));
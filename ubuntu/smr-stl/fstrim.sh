@@ -0,0 +1,27 @@
+# TRIM test - run after run.sh, with the filesystem mounted on /mnt/nbd.
+# fill it with files, delete every other one and fstrim, then overwrite
+# enough to make the STL clean, and check the files that are left
+
+sudo mkdir -p /mnt/nbd/t
+for i in $(seq 1 200); do
+    sudo dd of=/mnt/nbd/t/f$i if=/dev/urandom bs=64k count=$((i % 16 + 1)) 2>/dev/null
+done
+(cd /mnt/nbd/t && sudo md5sum f* > /tmp/fstrim.md5)
+
+for i in $(seq 1 2 200); do
+    sudo rm /mnt/nbd/t/f$i
+done
+grep -v 'f[0-9]*[13579]$' /tmp/fstrim.md5 > /tmp/fstrim.keep
+sync
+sudo fstrim -v /mnt/nbd
+
+# the freed space is trimmed, so cleaning shouldn't have to copy it
+for i in $(seq 1 4); do
+    sudo dd of=/mnt/nbd/t/churn if=/dev/urandom bs=1M count=200 conv=fsync 2>/dev/null
+    sudo rm /mnt/nbd/t/churn
+    sudo fstrim /mnt/nbd
+done
+
+sudo umount /mnt/nbd
+sudo mount /dev/nbd0 /mnt/nbd
+(cd /mnt/nbd/t && md5sum -c --quiet /tmp/fstrim.keep) && echo "fstrim test OK"
@@ -7,22 +7,73 @@
 #include <string.h>
 #include <nbdkit-plugin.h>
 #include <assert.h>
+#include <pthread.h>
 #include "stl.h"
 #include "stl_public.h"
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS
+/* the volume locks each group for the duration of an operation, so
+ * requests to different groups run in parallel. Unaligned writes do
+ * read-modify-write of the partial 4K sectors at either end, and two
+ * of those to different bytes of one sector would lose an update -
+ * so each holds one of RMW_LOCKS locks, picked by sector number.
+ */
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+#define RMW_LOCKS 64
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
 void *smr_dev;
+char *dev_name;
+int batch_kb, batch_usecs = 1000, dev_flags, cleaner = 1, frontiers;
+int sequential = -1, wcache_mb, rcache_mb, ck_interval;
+char *policy;
+pthread_mutex_t rmw_lock[RMW_LOCKS];
 
 int stlplugin_config(const char *key, const char *value)
 {
     if (!strcmp(key, "device")) {
-        if (!(smr_dev = init_volume(value))) {
-            nbdkit_error("failed to open %s\n", value);
-            return -1;
-        }
+        dev_name = strdup(value);
+        return 1;
+    }
+    else if (!strcmp(key, "policy")) {  /* greedy, cost-benefit, seeks */
+        policy = strdup(value);
+        return 1;
+    }
+    else if (!strcmp(key, "frontiers")) { /* write streams per group, 1-3 */
+        frontiers = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "sequential")) { /* stream threshold KB, 0=off */
+        sequential = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "wcache")) {  /* staging cache, MB */
+        wcache_mb = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "rcache")) {  /* extent read cache, MB */
+        rcache_mb = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "checkpoint")) { /* seq numbers between them */
+        ck_interval = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "cleaner")) { /* background cleaning thread */
+        cleaner = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "uring")) {   /* io_uring backend */
+        if (atoi(value))
+            dev_flags |= STL_URING;
+        return 1;
+    }
+    else if (!strcmp(key, "batch")) {   /* group commit size, KB */
+        batch_kb = atoi(value);
+        return 1;
+    }
+    else if (!strcmp(key, "batch_usecs")) {
+        batch_usecs = atoi(value);
         return 1;
     }
     else {
@@ -33,10 +84,39 @@ int stlplugin_config(const char *key, const char *value)
 
 int stlplugin_config_complete(void)
 {
-    if (!smr_dev) {
+    int i;
+    for (i = 0; i < RMW_LOCKS; i++)
+        pthread_mutex_init(&rmw_lock[i], NULL);
+    if (!dev_name) {
         nbdkit_error("no device specified\n");
         return -1;
     }
+    if (!(smr_dev = init_volume_flags(dev_name, dev_flags))) {
+        nbdkit_error("failed to open %s\n", dev_name);
+        return -1;
+    }
+    if (policy && volume_policy(smr_dev, policy) < 0) {
+        nbdkit_error("unknown cleaning policy %s\n", policy);
+        return -1;
+    }
+    if (frontiers < 0 || frontiers > 3) {
+        nbdkit_error("frontiers must be 1-3\n");
+        return -1;
+    }
+    if (frontiers > 0)
+        volume_frontiers(smr_dev, frontiers);
+    if (sequential >= 0)
+        volume_sequential(smr_dev, sequential);
+    if (wcache_mb > 0)
+        volume_wcache(smr_dev, wcache_mb);
+    if (rcache_mb > 0)
+        volume_rcache(smr_dev, rcache_mb);
+    if (ck_interval > 0)
+        volume_checkpoint_interval(smr_dev, ck_interval);
+    if (batch_kb > 0)
+        volume_batching(smr_dev, batch_kb, batch_usecs);
+    if (cleaner)
+        volume_cleaner(smr_dev, 1);
     return 1;
 }
 
@@ -61,7 +141,7 @@ int stlplugin_is_rotational(void *handle)
 
 int stlplugin_can_trim(void *handle)
 {
-    return 0;
+    return 1;
 }
 
 int stlplugin_can_flush (void *handle)
@@ -71,6 +151,7 @@ int stlplugin_can_flush (void *handle)
 
 int stlplugin_flush (void *handle)
 {
+    host_flush(smr_dev);
     return 0;
 }
 
@@ -109,6 +190,20 @@ int stlplugin_pread(void *handle, void *buf, uint32_t count, uint64_t offset)
     return 0;
 }
 
+/* write 'len' bytes at byte 'i' of 4K sector 'sector'
+ */
+static void write_partial(uint64_t sector, int i, const void *buf, int len)
+{
+    pthread_mutex_t *m = &rmw_lock[sector % RMW_LOCKS];
+    void *tmp = valloc(4096);
+    pthread_mutex_lock(m);
+    host_read(smr_dev, sector, tmp, 4096);
+    memcpy(tmp+i, buf, len);
+    host_write(smr_dev, sector, tmp, 4096);
+    pthread_mutex_unlock(m);
+    free(tmp);
+}
+
 int stlplugin_pwrite(void *handle, const void *buf, uint32_t count,
                      uint64_t offset)
 {
@@ -117,15 +212,11 @@ int stlplugin_pwrite(void *handle, const void *buf, uint32_t count,
 
     if ((offset & 4095) != 0) {
         nbdkit_debug("unaligned WRITE\n");
-        void *tmp = valloc(4096);
-        host_read(smr_dev, offset/4096, tmp, 4096);
         int i = offset % 4096, len = min(4096 - i, count);
-        memcpy(tmp+i, buf, len);
-        host_write(smr_dev, offset/4096, tmp, 4096);
+        write_partial(offset/4096, i, buf, len);
         buf += len;
         offset += len;
         count -= len;
-        free(tmp);
     }
 
     host_write(smr_dev, offset/4096, buf, count & ~4095);
@@ -136,27 +227,44 @@ int stlplugin_pwrite(void *handle, const void *buf, uint32_t count,
         buf += n;
         offset += n;
         count = count % 4096;
-        void *tmp = valloc(4096);
-        host_read(smr_dev, offset/4096, tmp, 4096);
-        memcpy(tmp, buf, count);
-        host_write(smr_dev, offset/4096, tmp, 4096);
-        free(tmp);
+        write_partial(offset/4096, 0, buf, count);
     }
 
     return 0;
 }
 
 
+/* only whole 4K sectors can be trimmed; TRIM is advisory, so the
+ * partial ones at either end are left alone.
+ */
 int stlplugin_trim(void *handle, uint32_t count, uint64_t offset)
 {
-    int n = offset % 4096;
-    offset += n;
-    count -= n;
-    if (n != 0 || count % 4096 != 0)
+    uint64_t lo = (offset + 4095) & ~4095ULL, hi = (offset + count) & ~4095ULL;
+    if (lo != offset || hi != offset + count)
         nbdkit_debug("unaligned TRIM\n");
+    if (hi > lo)
+        host_trim(smr_dev, lo / 4096, (hi - lo) / 4096);
 
-    count = count % 4096;
-    host_trim(smr_dev, offset / 4096, count / 4096);
+    return 0;
+}
+
+/* TRIMmed sectors read back as zeros, so whole sectors are zeroed by
+ * trimming them (even without may_trim - there's no allocation to
+ * preserve) and partial ones by writing zeros.
+ */
+int stlplugin_zero(void *handle, uint32_t count, uint64_t offset, int may_trim)
+{
+    uint64_t lo = (offset + 4095) & ~4095ULL, hi = (offset + count) & ~4095ULL;
+    if (hi < lo)
+        lo = hi = offset + count;
+    void *zeros = calloc(4096, 1);
+    if (lo > offset)
+        stlplugin_pwrite(handle, zeros, lo - offset, offset);
+    if (hi > lo)
+        host_trim(smr_dev, lo / 4096, (hi - lo) / 4096);
+    if (offset + count > hi)
+        stlplugin_pwrite(handle, zeros, offset + count - hi, hi);
+    free(zeros);
 
     return 0;
 }
@@ -173,6 +281,7 @@ static struct nbdkit_plugin plugin = {
   .pread             = stlplugin_pread,
   .pwrite            = stlplugin_pwrite,
   .trim              = stlplugin_trim,
+  .zero              = stlplugin_zero,
   .can_flush         = stlplugin_can_flush,
   .flush             = stlplugin_flush
 };
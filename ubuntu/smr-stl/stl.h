@@ -47,6 +47,8 @@ struct superblock {
     uint32_t group_span;        /* in 4K sectors */
     uint32_t n_groups;
     uint32_t map_size;          /* in bands */
+    uint32_t nonce;             /* random, new each format */
+    uint32_t crc;               /* CRC32C of the above */
 };
 
 /* any data or metadata written is wrapped by sectors in this format.
@@ -60,6 +62,8 @@ struct header {
     pba_t    next;
     pba_t    prev;
     pba_t    base;              /* only for MAP / BAND? */
+    uint32_t crc;               /* header + local records (stl_crc.h) */
+    uint32_t data_crc;          /* following sectors, metadata only */
                                 /* following: MAP,DATA: map_record */
                                 /* BAND: band_record */
 };
@@ -70,7 +74,9 @@ enum {
     RECORD_BAND=1,
     RECORD_MAP=2,
     RECORD_DATA=3,
-    RECORD_NULL=4
+    RECORD_NULL=4,
+    RECORD_BAND_RLE=5,
+    RECORD_MAP_DELTA=6
 };
 
 /* type=RECORD_BAND. Just indicates the band type.
@@ -89,13 +95,56 @@ struct map_record {
     int32_t  len;
 };
 
+/* checkpoints are written with the compact record types below, which
+ * are byte streams of unsigned LEB128 varints (7 bits per byte, high
+ * bit set on all but the last); 'records' in the header counts the
+ * records in the stream. RECORD_BAND and RECORD_MAP are still read.
+ *
+ * type=RECORD_BAND_RLE: runs of consecutive bands with the same type
+ * and write pointer, in band order, as 4 varints - bands skipped since
+ * the end of the previous run (from band 0 for the first), number of
+ * bands, type, write pointer.
+ *
+ * type=RECORD_MAP_DELTA: map records in LBA order, as 4 varints - lba
+ * minus the previous record's lba (the first is absolute), pba.band+1,
+ * pba.offset+1 (so PBA_INVALID is 0,0), len.
+ */
+static inline int varint_put(uint8_t *p, uint64_t x) {
+    int n = 0;
+    for (; x >= 0x80; x >>= 7)
+        p[n++] = x | 0x80;
+    p[n++] = x;
+    return n;
+}
+
+static inline int varint_len(uint64_t x) {
+    int n = 1;
+    for (; x >= 0x80; x >>= 7)
+        n++;
+    return n;
+}
+
+static inline uint64_t varint_get(const uint8_t **pp) {
+    const uint8_t *p = *pp;
+    uint64_t x = 0;
+    int shift = 0;
+    do
+        x |= (uint64_t)(*p & 0x7f) << shift, shift += 7;
+    while (*p++ & 0x80);
+    *pp = p;
+    return x;
+}
+
 /* not sure if band type goes here - it's more specific to the STL.
  */
 //#define BAND_CURRENT 0x80
 enum band_type {
     BAND_TYPE_FREE,
     BAND_TYPE_FULL,
-    BAND_TYPE_FRONTIER,
+    BAND_TYPE_FRONTIER,         /* host writes */
+    BAND_TYPE_FRONTIER_CLEAN,   /* data moved by the cleaner */
+    BAND_TYPE_FRONTIER_OLD,     /* data moved more than once */
+    BAND_TYPE_FRONTIER_SEQ,     /* sequential host streams */
     BAND_TYPE_MAX
 };
 
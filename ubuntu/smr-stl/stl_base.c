@@ -13,6 +13,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 /* Apple OSX rbtree implementation
  */
@@ -21,7 +25,10 @@
 #include "stl.h"
 #include "stl_map.h"
 #include "stl_fakesmr.h"
+#include "stl_rcache.h"
+#include "stl_crc.h"
 #include "stl_base.h"
+#include "stl_public.h"
 
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -34,6 +41,12 @@
 
 static void do_write(struct volume *v, int group, lba_t lba,
                      const void *buf, int sectors, int prio);
+static void write_records(struct volume *v, int group, int stream,
+                          struct map_record *recs, int n, const void *buf,
+                          int prio);
+static void kick_cleaner(struct volume *v, int g);
+static int64_t usecs_now(void);
+static void batch_expire(struct volume *v);
 
 /*----------- Helper functions for band/offset PBAs ---------------*/
 
@@ -51,6 +64,247 @@ pba_t long2pba(struct volume *v,  int64_t addr)
 
 #define PBA_NEXT (struct pba){.band = 0xFFFFFFFF, .offset=0xFFFFFFFF}
 
+/* host writes checkpoint after this many sequence numbers (about two
+ * per packet written) by default - see volume_checkpoint_interval
+ */
+#define CK_INTERVAL 2000
+
+/* checkpoint records are written in chunks of this many sectors, and
+ * staged (before encoding) in a buffer of CK_RECS records - none of the
+ * compact records is shorter than 4 bytes.
+ */
+#define CK_CHUNK 16
+#define CK_RECS (CK_CHUNK * SECTOR_SIZE / 4)
+
+/* sequential streams - detection threshold (see volume_sequential),
+ * max data per packet, and max time data waits to be written
+ */
+#define SEQ_DEFAULT_KB 512
+#define SEQ_MAX_SECTORS 2048
+#define SEQ_USECS 100000
+
+/* max map records that fit in the trailer of a data packet
+ */
+#define DATA_RECORDS ((SECTOR_SIZE - sizeof(struct header)) / \
+                      sizeof(struct map_record))
+
+
+static int group_of(struct volume *v, int band)
+{
+    return (band - 1 - v->map_size) / v->group_size;
+}
+
+/*----------- Band utilization ---------------*/
+
+/* Each band counts the live sectors and extents mapped to it, and
+ * full bands sit on a per-group list for their utilization bucket,
+ * so the emptiest band is found without scanning the map. All of
+ * this is updated under map_lock.
+ */
+static void band_unbucket(struct volume *v, int b)
+{
+    struct band *bb = &v->band[b];
+    struct group *gr = &v->groups[group_of(v, b)];
+    if (bb->bucket < 0)
+        return;
+    if (bb->b_prev >= 0)
+        v->band[bb->b_prev].b_next = bb->b_next;
+    else
+        gr->bucket[bb->bucket] = bb->b_next;
+    if (bb->b_next >= 0)
+        v->band[bb->b_next].b_prev = bb->b_prev;
+    bb->bucket = -1;
+}
+
+/* put a band on the right list for its type and utilization
+ */
+static void band_rebucket(struct volume *v, int b)
+{
+    struct band *bb = &v->band[b];
+    int i = -1;
+    if (b <= v->map_size || b >= 1 + v->map_size + v->n_groups * v->group_size)
+        return;
+    if (bb->type == BAND_TYPE_FULL)
+        i = bb->live_sectors * N_BUCKETS / (v->band_size + 1);
+    if (i == bb->bucket)
+        return;
+    band_unbucket(v, b);
+    if (i < 0)
+        return;
+    struct group *gr = &v->groups[group_of(v, b)];
+    bb->bucket = i;
+    bb->b_prev = -1;
+    bb->b_next = gr->bucket[i];
+    if (bb->b_next >= 0)
+        v->band[bb->b_next].b_prev = b;
+    gr->bucket[i] = b;
+}
+
+/* account for 'sectors' / 'extents' more (or less) mapped at 'pba'.
+ * TRIM entries (PBA_INVALID) don't belong to a band.
+ */
+static void band_live(struct volume *v, pba_t pba, int sectors, int extents)
+{
+    if (pba.band <= v->map_size || pba.band >= v->n_bands)
+        return;
+    struct band *bb = &v->band[pba.band];
+    bb->live_sectors += sectors;
+    bb->live_extents += extents;
+    assert(bb->live_sectors >= 0 && bb->live_extents >= 0);
+    band_rebucket(v, pba.band);
+}
+
+/* the full band with the fewest live sectors in group 'g', or -1.
+ * Only the lowest non-empty bucket needs to be searched.
+ */
+static int emptiest_band(struct volume *v, int g)
+{
+    int i, b, min_b = -1;
+    for (i = 0; i < N_BUCKETS; i++)
+        if (v->groups[g].bucket[i] >= 0)
+            break;
+    if (i == N_BUCKETS)
+        return -1;
+    for (b = v->groups[g].bucket[i]; b >= 0; b = v->band[b].b_next)
+        if (min_b < 0 || v->band[b].live_sectors < v->band[min_b].live_sectors)
+            min_b = b;
+    return min_b;
+}
+
+/*----------- Checkpoint lists ---------------*/
+
+/* see struct elist. All of this is under map_lock.
+ */
+static void elist_remove(struct elist *l, struct entry *e)
+{
+    if (e->ck_prev)
+        e->ck_prev->ck_next = e->ck_next;
+    else
+        l->head = e->ck_next;
+    if (e->ck_next)
+        e->ck_next->ck_prev = e->ck_prev;
+    else
+        l->tail = e->ck_prev;
+    l->n--;
+}
+
+static void elist_append(struct elist *l, struct entry *e)
+{
+    e->ck_next = NULL;
+    e->ck_prev = l->tail;
+    if (l->tail)
+        l->tail->ck_next = e;
+    else
+        l->head = e;
+    l->tail = e;
+    l->n++;
+}
+
+/* move all of 'l2' onto the end of 'l1'
+ */
+static void elist_concat(struct elist *l1, struct elist *l2)
+{
+    if (l2->head == NULL)
+        return;
+    if (l1->tail) {
+        l1->tail->ck_next = l2->head;
+        l2->head->ck_prev = l1->tail;
+    }
+    else
+        l1->head = l2->head;
+    l1->tail = l2->tail;
+    l1->n += l2->n;
+    *l2 = (struct elist){.head = NULL};
+}
+
+/* a new, dirty, map entry
+ */
+static struct entry *entry_new(struct volume *v, lba_t lba, pba_t pba,
+                               int len, uint32_t seq)
+{
+    struct entry *e = stl_map_entry(v->map, sizeof(*e));
+    *e = (struct entry){.lba = lba, .pba = pba, .len = len, .seq = seq,
+                        .dirty = 1};
+    stl_map_insert(v->map, e, lba, pba, len);
+    elist_append(&v->dirty, e);
+    return e;
+}
+
+static void entry_dirty(struct volume *v, struct entry *e, uint32_t seq)
+{
+    e->seq = seq;
+    if (!e->dirty) {
+        elist_remove(&v->clean, e);
+        e->dirty = 1;
+        elist_append(&v->dirty, e);
+    }
+}
+
+static void entry_remove(struct volume *v, struct entry *e)
+{
+    elist_remove(e->dirty ? &v->dirty : &v->clean, e);
+    stl_map_remove(v->map, e);
+}
+
+static void band_clean_remove(struct volume *v, int b)
+{
+    struct band *bb = &v->band[b];
+    if (bb->ck_prev >= 0)
+        v->band[bb->ck_prev].ck_next = bb->ck_next;
+    else
+        v->band_head = bb->ck_next;
+    if (bb->ck_next >= 0)
+        v->band[bb->ck_next].ck_prev = bb->ck_prev;
+    else
+        v->band_tail = bb->ck_prev;
+}
+
+static void band_clean_append(struct volume *v, int b)
+{
+    struct band *bb = &v->band[b];
+    bb->ck_next = -1;
+    bb->ck_prev = v->band_tail;
+    if (v->band_tail >= 0)
+        v->band[v->band_tail].ck_next = b;
+    else
+        v->band_head = b;
+    v->band_tail = b;
+}
+
+/* the band record for a data band needs to be checkpointed
+ */
+static void band_dirty(struct volume *v, int b)
+{
+    assert(b > v->map_size);
+    if (v->band[b].dirty)
+        return;
+    v->band[b].dirty = 1;
+    band_clean_remove(v, b);
+    v->dirty_bands[v->n_dirty_bands++] = b;
+}
+
+/* a new TRIM of lba..+len, once the range has been cleared: absorb
+ * any TRIM entries right before and after it, so a run of TRIMs costs
+ * one entry and one checkpoint record. (the neighbours are replaced
+ * rather than extended, as an entry's key can't move down in place)
+ */
+static void trim_merge(struct volume *v, lba_t *lba, int *len)
+{
+    struct entry *prev = (*lba > 0) ? stl_map_lba_geq(v->map, *lba-1) : NULL;
+    struct entry *next = stl_map_lba_geq(v->map, *lba + *len);
+
+    if (prev != NULL && prev->lba + prev->len == *lba &&
+        pba_eq(prev->pba, PBA_INVALID)) {
+        *lba = prev->lba;
+        *len += prev->len;
+        entry_remove(v, prev);
+    }
+    if (next != NULL && next->lba == *lba + *len &&
+        pba_eq(next->pba, PBA_INVALID)) {
+        *len += next->len;
+        entry_remove(v, next);
+    }
+}
 
 /* Update mapping. Removes any total overlaps, edits any partial
  * overlaps, adds new extent to forward and reverse map.
@@ -71,24 +325,21 @@ static void update_range(struct volume *v, pba_t location, lba_t lba, int len,
             int new_len = e->lba + e->len - new_lba;
             assert(new_len > 0);
 
-            pba_t new_pba = pba_add(e->pba, (e->len - new_len));
-            struct entry *_new2 = stl_map_entry(sizeof(struct entry));
-            *_new2 = (struct entry){.lba = lba+len, .pba = new_pba,
-                                    .len = new_len, .seq = seq, .dirty = 1};
+            pba_t new_pba = pba_eq(e->pba, PBA_INVALID) ? PBA_INVALID :
+                pba_add(e->pba, (e->len - new_len));
 
             printf("split %d,+%d -> %d.%d into ",
                    (int)e->lba, e->len, e->pba.band, e->pba.offset);
                    
+            band_live(v, e->pba, -len, 1);
             e->len = lba - e->lba; /* do this *before* inserting below */
             printf("%d,+%d -> %d.%d %d,+%d -> %d.%d\n",
                    (int)e->lba, e->len, e->pba.band, e->pba.offset,
-                   (int)_new2->lba, _new2->len, _new2->pba.band, _new2->pba.offset);
+                   (int)(lba+len), new_len, new_pba.band, new_pba.offset);
             stl_map_update(e, e->lba, e->pba, e->len);
-            e->dirty = 1;
-            e->seq = seq;
+            entry_dirty(v, e, seq);
             assert(e->len > 0);
-            stl_map_insert(v->map, _new2, _new2->lba, _new2->pba, _new2->len);
-            e = _new2;
+            e = entry_new(v, lba+len, new_pba, new_len, seq);
         }
         /* [------------]
          *        [+++++++++]        -> [------][+++++++++]
@@ -96,13 +347,13 @@ static void update_range(struct volume *v, pba_t location, lba_t lba, int len,
         else if (e->lba < lba) {
             printf("overlap tail %d,+%d -> %d.%d becomes", (int)e->lba, e->len,
                    e->pba.band, e->pba.offset);
+            band_live(v, e->pba, (lba - e->lba) - e->len, 0);
             e->len = lba - e->lba;
             printf(" %d,+%d -> %d.%d\n", (int)e->lba, e->len, 
                    e->pba.band, e->pba.offset);
             stl_map_update(e, e->lba, e->pba, e->len);
             assert(e->len > 0);
-            e->dirty = 1;
-            e->seq = seq;
+            entry_dirty(v, e, seq);
             e = stl_map_lba_iterate(v->map, e);
         }
         /*          [------]
@@ -112,7 +363,8 @@ static void update_range(struct volume *v, pba_t location, lba_t lba, int len,
             printf("overwriting %d,+%d -> %d.%d\n",  (int)e->lba, e->len,
                    e->pba.band, e->pba.offset);
             struct entry *tmp = stl_map_lba_iterate(v->map, e);
-            stl_map_remove(v->map, e);
+            band_live(v, e->pba, -e->len, -1);
+            entry_remove(v, e);
             e = tmp;
         }
         /*          [------]
@@ -122,15 +374,16 @@ static void update_range(struct volume *v, pba_t location, lba_t lba, int len,
             printf("overlap head %d,+%d -> %d.%d becomes", (int)e->lba, e->len,
                    e->pba.band, e->pba.offset);
             int n = (lba+len)-e->lba;
+            band_live(v, e->pba, -n, 0);
             e->lba += n;
-            e->pba.offset += n;
+            if (!pba_eq(e->pba, PBA_INVALID))
+                e->pba.offset += n;
             e->len -= n;
             printf(" %d,+%d -> %d.%d\n", (int)e->lba, e->len, 
                    e->pba.band, e->pba.offset);
             stl_map_update(e, e->lba, e->pba, e->len);
             assert(e->len > 0);
-            e->seq = seq;
-            e->dirty = 1;
+            entry_dirty(v, e, seq);
         }
     }
 
@@ -139,52 +392,106 @@ static void update_range(struct volume *v, pba_t location, lba_t lba, int len,
      * removed from the map. When we read it on startup, location!=0,0
      * - all the work was done above by clearing the LBA range.
      */
+    if (pba_eq(pba, PBA_INVALID) && pba_eq(location, PBA_NULL))
+        trim_merge(v, &lba, &len);
     if (!pba_eq(pba, PBA_INVALID) || pba_eq(location, PBA_NULL)) {
-        struct entry *_new = stl_map_entry(sizeof(*_new));
-        *_new = (struct entry){.lba = lba, .pba = pba, .len = len,
-                               .seq = seq, .dirty = 1};
-        stl_map_insert(v->map, _new, lba, pba, len);
+        e = entry_new(v, lba, pba, len, seq);
+        band_live(v, pba, len, 1);
+
+        /* loaded from a checkpoint, so it's clean. (records are read
+         * in log order, so the clean list stays in seq order)
+         */
+        if (!pba_eq(location, PBA_NULL)) {
+            elist_remove(&v->dirty, e);
+            e->dirty = 0;
+            e->location = location;
+            elist_append(&v->clean, e);
+        }
     }
 }
 
 /*------------------- Initialization ---------------------*/
 
-/* note that this works perfectly for TRIM logging, as well.
+/* note that this works perfectly for TRIM logging, as well. A TRIM
+ * record isn't in any band, and merged TRIMs can be longer than one.
  */
 static void read_map_record(struct volume *v, pba_t location,
                             struct map_record *m, uint32_t seq)
 {
     assert(m->pba.band < v->n_bands &&
-           (m->pba.offset+m->len) <= v->band_size &&
+           (pba_eq(m->pba, PBA_INVALID) ||
+            (m->pba.offset+m->len) <= v->band_size) &&
            (m->lba+m->len) <= v->group_span*v->n_groups);
     /* tag range with location it's checkpointed in */
     update_range(v, location, m->lba, m->len, m->pba, seq);
 }
 
-static int group_of(struct volume *v, int band)
-{
-    return (band - 1 - v->map_size) / v->group_size;
-}
-
-static void read_band_record(struct volume *v, struct band_record *b,
-                             uint32_t seq)
+static void read_band_record(struct volume *v, pba_t location,
+                             struct band_record *b, uint32_t seq)
 {
     assert(b->band < v->n_bands && b->type < BAND_TYPE_MAX);
     int i = b->band;
     v->band[i].type = b->type;
     v->band[i].dirty = 0;
-    v->band[i].seq = seq;
-    if (b->type == BAND_TYPE_FRONTIER) { 
-        v->groups[group_of(v, i)].frontier = i;
-        v->groups[group_of(v, i)].frontier_offset = b->write_pointer; 
+    v->band[i].seq = v->band[i].data_seq = v->band[i].ck_seq = seq;
+    v->band[i].ck_location = location;
+    v->band[i].ck_wp = b->write_pointer;
+    if (IS_FRONTIER(b->type)) {
+        int s = b->type - BAND_TYPE_FRONTIER;
+        v->groups[group_of(v, i)].frontier[s] = i;
+        v->groups[group_of(v, i)].frontier_offset[s] = b->write_pointer; 
+        v->band[i].stream = s;
+    }
+}
+
+/* Mount reads map bands in chunks of MOUNT_CHUNK sectors and parses
+ * headers and records from memory; a reader holds the last chunk it
+ * read. Frontiers are scanned by up to MOUNT_THREADS threads, reading
+ * CHASE_CHUNK sectors at a time - data packets can be big, and only
+ * their headers and trailers are needed.
+ */
+#define MOUNT_CHUNK 256
+#define CHASE_CHUNK 16
+#define MOUNT_THREADS 8
+
+struct reader {
+    int   chunk;                /* sectors per read */
+    int   band, lo, hi;         /* sectors lo..hi-1 of band are in buf */
+    void *buf;
+    int   size;                 /* sectors allocated */
+    int64_t reads, sectors;
+};
+
+/* sectors offset..offset+n-1 of 'band', which must be below the write
+ * pointer. On a miss reads a chunk starting at 'offset', or ending
+ * at offset+n if scanning backwards.
+ */
+static void *reader_get(struct volume *v, struct reader *r, int band,
+                        int offset, int n, int backwards)
+{
+    int wp = v->band[band].write_pointer;
+    assert(offset >= 0 && offset + n <= wp);
+    if (band != r->band || offset < r->lo || offset + n > r->hi) {
+        int len = max(n, r->chunk);
+        int lo = backwards ? max(0, offset + n - len) : offset;
+        int hi = min(wp, lo + len);
+        if (hi - lo > r->size) {
+            free(r->buf);
+            r->buf = valloc((hi - lo) * SECTOR_SIZE);
+            r->size = hi - lo;
+        }
+        smr_read(v->disk, band, lo, r->buf, hi - lo);
+        r->band = band, r->lo = lo, r->hi = hi;
+        r->reads++;
+        r->sectors += hi - lo;
     }
+    return r->buf + (int64_t)(offset - r->lo) * SECTOR_SIZE;
 }
 
-static pba_t read_records(struct volume *v, pba_t location)
+static pba_t read_records(struct volume *v, struct reader *rd, pba_t location)
 {
-    struct header *h = v->buf;
-    smr_read(v->disk, location.band, location.offset, v->buf, 1);
-    assert(h->magic == STL_MAGIC);
+    struct header *h = reader_get(v, rd, location.band, location.offset, 1, 0);
+    assert(hdr_valid(v->nonce, h));
 
     int i;
     uint32_t seq = h->seq;
@@ -193,71 +500,281 @@ static pba_t read_records(struct volume *v, pba_t location)
     int nsectors = h0.next.offset - location.offset - 1;
     void *buf = NULL;
 
-    if (h0.records > 0)
-        buf = valloc(nsectors * SECTOR_SIZE);
-
+    /* local records first - 'h' is gone once the records are read
+     */
     if (h0.type == RECORD_BAND) {
         struct band_record *r = (void*)(h+1);
         for (i = 0; i < h->local_records; i++)
-            read_band_record(v, &r[i], seq);
-        if (nsectors != 0){
-            smr_read(v->disk, location.band, location.offset+1, buf, nsectors);
-        }
-        int hmax = nsectors * SECTOR_SIZE / sizeof(struct band_record);
-        r = buf;
-        for (i = 0; i < h0.records && i < hmax; i++)
-            read_band_record(v, &r[i], seq);
+            read_band_record(v, location, &r[i], seq);
     }
     if (h0.type == RECORD_MAP) {
         struct map_record *m = (void*)(h+1);
         for (i = 0; i < h->local_records; i++)
             read_map_record(v, location, &m[i], seq);
-        if(nsectors>0){
-            smr_read(v->disk, location.band, location.offset+1, buf, nsectors);
-        }
+    }
+    if (h0.records > 0 && nsectors > 0) {
+        buf = reader_get(v, rd, location.band, location.offset+1, nsectors, 0);
+        assert(crc32c(v->nonce, buf, nsectors * SECTOR_SIZE) == h0.data_crc);
+    }
+    else
+        nsectors = 0;
+
+    if (h0.type == RECORD_BAND) {
+        int hmax = nsectors * SECTOR_SIZE / sizeof(struct band_record);
+        struct band_record *r = buf;
+        for (i = 0; i < h0.records && i < hmax; i++)
+            read_band_record(v, location, &r[i], seq);
+    }
+    if (h0.type == RECORD_MAP) {
         int hmax = nsectors * SECTOR_SIZE / sizeof(struct map_record);
-        m = buf;
+        struct map_record *m = buf;
         for (i = 0; i < h0.records && i < hmax; i++)
             read_map_record(v, location, &m[i], seq);
     }
+    if (h0.type == RECORD_BAND_RLE || h0.type == RECORD_MAP_DELTA) {
+        const uint8_t *p = buf, *end = p + nsectors * SECTOR_SIZE;
+        lba_t lba = 0;
+        int j, band = 0;
+        for (i = 0; i < h0.records && p < end; i++) {
+            if (h0.type == RECORD_MAP_DELTA) {
+                struct map_record m;
+                m.lba = lba += varint_get(&p);
+                m.pba.band = (int)varint_get(&p) - 1;
+                m.pba.offset = (int)varint_get(&p) - 1;
+                m.len = varint_get(&p);
+                read_map_record(v, location, &m, seq);
+            }
+            else {
+                struct band_record b;
+                band += varint_get(&p);
+                int n = varint_get(&p);
+                b.type = varint_get(&p);
+                b.write_pointer = varint_get(&p);
+                for (j = 0; j < n; j++) {
+                    b.band = band++;
+                    read_band_record(v, location, &b, seq);
+                }
+            }
+        }
+    }
 
-    if (buf)
-        free(buf);
     v->map_prev = location;
     return h0.next;
 }
 
-struct data_pkt {
-    struct header h;
-    struct map_record map;
+/* Roll-forward: map records from data packets written after the last
+ * checkpoint. Each frontier's chain of headers is followed from the
+ * checkpointed write pointer, across the headers that close out a
+ * band, to the first invalid header; a band is only walked by the
+ * first chain to claim it. Then bands that were started after the
+ * checkpoint but that no chain reached (a stream's first band) are
+ * walked from the start. The records are applied in sequence order.
+ */
+struct chase_rec {
+    uint32_t seq;
+    int      i;                 /* order found, to keep the sort stable */
+    struct map_record m;
 };
 
-static int chase_frontiers(struct volume *v)
+struct chain {
+    pba_t    start;
+    int      stream;            /* -1: not on a known frontier */
+    struct chase_rec *recs;
+    int      n_recs;
+    int     *bands;             /* with packets on the chain, in order */
+    int      n_bands;
+    uint32_t max_seq;           /* of any header on it */
+};
+
+struct chase {
+    struct volume *v;
+    struct chain *chains;
+    int      n_chains;
+    int      next;              /* next chain to walk */
+    uint32_t ck_seq;            /* seq of the checkpoint we mounted */
+    char    *claimed;           /* per band */
+    int64_t  reads, sectors;
+    pthread_mutex_t lock;       /* reads, sectors */
+};
+
+static void chase_chain(struct chase *c, struct chain *ch, struct reader *rd)
 {
-    struct header *h = v->buf;
-    int i, max_seq, dirty = 0;
-    
-    for (i = 0; i < v->n_groups; i++) {
-        int f = v->groups[i].frontier;
-        if (v->band[f].write_pointer == 0) {
+    struct volume *v = c->v;
+    int j, size = 0, bsize = 0;
+    uint32_t seq = 0;
+    pba_t here = ch->start;
+
+    while (here.band > v->map_size && here.band < v->n_bands &&
+           here.offset >= 0 && here.offset < v->band[here.band].write_pointer) {
+        struct header *h = reader_get(v, rd, here.band, here.offset, 1, 0);
+        if (!hdr_valid(v->nonce, h) || h->type != RECORD_DATA || h->seq < seq)
+            break;
+        /* a band started after the checkpoint, or one the chain
+         * crossed into - which nobody else may walk
+         */
+        if (ch->n_bands == 0 || ch->bands[ch->n_bands-1] != here.band) {
+            if (ch->stream < 0 && ch->n_bands == 0 && h->seq <= c->ck_seq)
+                break;
+            if (ch->n_bands > 0 &&
+                !__sync_bool_compare_and_swap(&c->claimed[here.band], 0, 1))
+                break;
+            if (ch->n_bands == bsize)
+                ch->bands = realloc(ch->bands, (bsize += 8) * sizeof(int));
+            ch->bands[ch->n_bands++] = here.band;
+        }
+        seq = ch->max_seq = h->seq;
+        struct map_record *m = (void*)(h+1);
+        for (j = 0; j < h->local_records; j++) {
+            if (ch->n_recs == size)
+                ch->recs = realloc(ch->recs, (size = size ? 2*size : 64) *
+                                   sizeof(*ch->recs));
+            ch->recs[ch->n_recs++] = (struct chase_rec){.seq = h->seq,
+                                                        .m = m[j]};
+        }
+        here = h->next;
+    }
+}
+
+static void *chase_thread(void *arg)
+{
+    struct chase *c = arg;
+    struct reader rd = {.chunk = CHASE_CHUNK, .band = -1};
+    int i;
+    while ((i = __sync_fetch_and_add(&c->next, 1)) < c->n_chains)
+        chase_chain(c, &c->chains[i], &rd);
+    free(rd.buf);
+    pthread_mutex_lock(&c->lock);
+    c->reads += rd.reads;
+    c->sectors += rd.sectors;
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+static void chase_run(struct chase *c)
+{
+    int i, n_threads = min(MOUNT_THREADS, c->n_chains);
+    pthread_t th[MOUNT_THREADS];
+    c->next = 0;
+    for (i = 0; i < n_threads; i++)
+        pthread_create(&th[i], NULL, chase_thread, c);
+    for (i = 0; i < n_threads; i++)
+        pthread_join(th[i], NULL);
+}
+
+static int chase_cmp(const void *a, const void *b)
+{
+    const struct chase_rec *r1 = a, *r2 = b;
+    if (r1->seq != r2->seq)
+        return (r1->seq > r2->seq) - (r1->seq < r2->seq);
+    return r1->i - r2->i;
+}
+
+/* a band whose type changed in roll-forward. The clean band list
+ * isn't built yet, so it just goes on the dirty stack.
+ */
+static void chase_band(struct volume *v, int b, int type, int stream)
+{
+    v->band[b].type = type;
+    v->band[b].stream = stream;
+    if (!v->band[b].dirty) {
+        v->band[b].dirty = 1;
+        v->dirty_bands[v->n_dirty_bands++] = b;
+    }
+}
+
+/* roll forward from the frontiers, then fix up the band table:
+ * bands a chain moved on from are full, the last band on a frontier's
+ * chain is its new frontier, and free bands with nothing valid on
+ * them are reset. Returns the number of map records applied.
+ */
+static int chase_frontiers(struct volume *v, uint32_t ck_seq)
+{
+    int i, j, k, n, nf = v->n_groups * N_FRONTIERS;
+    struct chase c = {.v = v, .ck_seq = ck_seq,
+                      .claimed = calloc(v->n_bands, 1),
+                      .chains = calloc(nf + v->n_bands, sizeof(struct chain))};
+    pthread_mutex_init(&c.lock, NULL);
+
+    for (i = 0; i < nf; i++) {
+        struct group *gr = &v->groups[i / N_FRONTIERS];
+        int f = gr->frontier[i % N_FRONTIERS];
+        if (f < 0 || v->band[f].type != FRONTIER_TYPE(i % N_FRONTIERS))
             continue;
+        c.claimed[f] = 1;
+        c.chains[c.n_chains++] = (struct chain){
+            .start = mkpba(f, gr->frontier_offset[i % N_FRONTIERS]),
+            .stream = i % N_FRONTIERS};
+    }
+    chase_run(&c);
+
+    /* bands that have been written since their checkpointed record
+     * and weren't on any chain
+     */
+    int first = c.n_chains;
+    for (i = 1+v->map_size; i < v->n_bands; i++) {
+        struct band *b = &v->band[i];
+        if (!c.claimed[i] && b->write_pointer > 0 &&
+            (b->type == BAND_TYPE_FREE || b->write_pointer != b->ck_wp)) {
+            c.claimed[i] = 1;
+            c.chains[c.n_chains++] = (struct chain){.start = mkpba(i, 0),
+                                                    .stream = -1};
         }
-        int offset = v->groups[i].frontier_offset;
-        smr_read(v->disk, f, offset, v->buf, 1);
-        while (h->next.offset < v->band[h->next.band].write_pointer){
-            smr_read(v->disk, h->next.band, h->next.offset, v->buf, 1);
-            if (h->local_records > 0) {
-                 read_map_record(v, PBA_NULL, (struct map_record*) (h+1), h->seq);
-            }
-            if (h->seq > max_seq) {
-                max_seq = h->seq;
-            }
+    }
+    if (c.n_chains > first)
+        chase_run(&c);
+
+    for (i = n = 0; i < c.n_chains; i++)
+        n += c.chains[i].n_recs;
+    struct chase_rec *all = malloc((n + 1) * sizeof(*all));
+    for (i = n = 0; i < c.n_chains; i++) {
+        struct chain *ch = &c.chains[i];
+        for (j = 0; j < ch->n_recs; j++, n++) {
+            all[n] = ch->recs[j];
+            all[n].i = n;
+        }
+        if (ch->n_bands > 0 && ch->max_seq + 1 > (uint32_t)v->seq)
+            v->seq = ch->max_seq + 1;
+        for (k = 0; k < ch->n_bands; k++) {
+            int b = ch->bands[k];
+            if (k == ch->n_bands-1 && ch->stream >= 0)
+                chase_band(v, b, FRONTIER_TYPE(ch->stream), ch->stream);
+            else
+                chase_band(v, b, BAND_TYPE_FULL, v->band[b].stream);
+        }
+        free(ch->recs);
+        free(ch->bands);
+    }
+    qsort(all, n, sizeof(*all), chase_cmp);
+    for (i = 0; i < n; i++)
+        read_map_record(v, PBA_NULL, &all[i].m, all[i].seq);
+
+    /* whatever's left on a free band is garbage, and a full band with
+     * nothing on it was cleaned after the checkpoint.
+     */
+    for (i = 1+v->map_size; i < v->n_bands; i++) {
+        struct band *b = &v->band[i];
+        if (b->type == BAND_TYPE_FREE && b->write_pointer > 0) {
+            smr_reset_pointer(v->disk, i);
+            b->write_pointer = 0;
         }
+        if (b->type == BAND_TYPE_FULL && b->write_pointer == 0)
+            chase_band(v, i, BAND_TYPE_FREE, 0);
     }
-    v->seq = max_seq;
-    return 1;
+
+    v->mount.reads += c.reads;
+    v->mount.sectors += c.sectors;
+    pthread_mutex_destroy(&c.lock);
+    free(all);
+    free(c.chains);
+    free(c.claimed);
+    return n;
 }
 
+struct data_pkt {
+    struct header h;
+    struct map_record map;
+};
+
 /* track them down in order of sequence number and apply them.
  */
 // static int chase_frontiers(struct volume *v)
@@ -325,183 +842,424 @@ static int chase_frontiers(struct volume *v)
 // }
 
 
-struct volume *init_volume(const char *dev)
+static int ck_seq_cmp(const void *a, const void *b, void *arg)
+{
+    struct volume *v = arg;
+    uint32_t s1 = v->band[*(const int*)a].ck_seq;
+    uint32_t s2 = v->band[*(const int*)b].ck_seq;
+    return (s1 > s2) - (s1 < s2);
+}
+
+struct volume *init_volume_flags(const char *dev, int flags)
 {
     int i, j, k, seq, m;
     struct volume *v = calloc(sizeof(*v), 1);
+    int64_t t0 = usecs_now(), t = t0;
     v->buf = valloc(SECTOR_SIZE);
+    pthread_mutex_init(&v->map_lock, NULL);
+    pthread_mutex_init(&v->clean_lock, NULL);
+    pthread_cond_init(&v->clean_cv, NULL);
+    pthread_cond_init(&v->space_cv, NULL);
 
     v->map = stl_map_init();
 
-    if ((v->disk = smr_open(dev)) == NULL)
+    if ((v->disk = smr_open_flags(dev, (flags & STL_URING) ? SMR_URING : SMR_SYNC)) == NULL)
         return NULL;
 
     smr_read(v->disk, 0, 0, v->buf, 1); /* read 1 sector */
     struct superblock *sb = v->buf;
     assert(sb->magic == STL_MAGIC);
+    assert(sb->crc == crc32c(0, sb, offsetof(struct superblock, crc)));
+    v->nonce = sb->nonce;
 
     /* note that we assume all bands are equal-sized. (ignore last one?)
      */
     v->band_size = smr_band_size(v->disk);
     v->n_bands = smr_n_bands(v->disk);
+    assert(v->band_size > CK_CHUNK + 4);
     v->band = calloc(v->n_bands * sizeof(v->band[0]), 1);
-    for (i = 0; i < v->n_bands; i++)
+    for (i = 0; i < v->n_bands; i++) {
         v->band[i].write_pointer = smr_write_pointer(v->disk, i);
+        v->band[i].bucket = -1;
+        v->band[i].ck_prev = v->band[i].ck_next = -1;
+    }
+    v->dirty_bands = calloc(v->n_bands, sizeof(int));
+    v->ck_buf = valloc(CK_CHUNK * SECTOR_SIZE);
+    memset(v->ck_buf, 0, CK_CHUNK * SECTOR_SIZE);
+    v->ck_recs = malloc(CK_RECS * sizeof(struct map_record));
+    v->band_head = v->band_tail = -1;
     
     v->map_size = sb->map_size;
     v->group_size = sb->group_size;
     v->group_span = sb->group_span;
     v->n_groups = sb->n_groups;
     v->groups = calloc(v->n_groups * sizeof(*v->groups), 1);
+    for (i = 0; i < v->n_groups; i++) {
+        v->groups[i].pkt_buf = valloc(2 * SECTOR_SIZE);
+        pthread_mutex_init(&v->groups[i].lock, NULL);
+        for (j = 0; j < N_BUCKETS; j++)
+            v->groups[i].bucket[j] = -1;
+        for (j = 0; j < N_FRONTIERS; j++)
+            v->groups[i].frontier[j] = -1;
+    }
+    v->need_clean = calloc((v->n_groups + 63) / 64, sizeof(uint64_t));
+    v->stalled = calloc((v->n_groups + 63) / 64, sizeof(uint64_t));
+    v->n_frontiers = 2;
+    v->seq_sectors = SEQ_DEFAULT_KB * 1024 / SECTOR_SIZE;
+    v->ck_interval = CK_INTERVAL;
 
     /* Find the current map band - i.e. the one starting with the
-     * highest sequence number.
+     * highest sequence number. The first sectors are read all at once.
      */
-    struct header *h = v->buf;
+    struct header *h;
+    void *heads = valloc(v->map_size * SECTOR_SIZE);
+    v->map_seq = calloc(v->map_size + 1, sizeof(uint32_t));
+    for (i = 1; i <= v->map_size; i++)
+        if (v->band[i].write_pointer > 0)
+            smr_read_async(v->disk, i, 0, heads + (i-1)*SECTOR_SIZE, 1);
+    smr_wait(v->disk);
     for (i = 1, seq = -1; i <= v->map_size; i++) {
+        h = heads + (i-1)*SECTOR_SIZE;
         if (v->band[i].write_pointer == 0)
             continue;
-        smr_read(v->disk, i, 0, v->buf, 1);
-        if (h->magic == STL_MAGIC && (int)h->seq > seq) {
+        v->mount.reads++;
+        v->mount.sectors++;
+        if (!hdr_valid(v->nonce, h))
+            continue;
+        v->map_seq[i] = h->seq;
+        if ((int)h->seq > seq) {
             seq = h->seq;
             m = i;
         }
     }
+    free(heads);
     assert(seq > -1);
+    v->mount.heads_usecs = usecs_now() - t;
+    t = usecs_now();
 
     /* Find the last record in the current map band by searching backwards from
      * write_pointer-1.  Offset of last legal header will be in 'i'. 
      */
+    struct reader rd = {.chunk = MOUNT_CHUNK, .band = -1};
     v->map_band = m;
     for (i = v->band[m].write_pointer - 1; i > 0; i--) {
-       
-        smr_read(v->disk, m, i, v->buf, 1);
-    
-        if (h->magic == STL_MAGIC && h->seq >= seq && h->next.band == m)
+        h = reader_get(v, &rd, m, i, 1, 1);
+        if (hdr_valid(v->nonce, h) && h->seq >= seq && h->next.band == m)
             break;
     }
     assert(i != -1);
     // ->band[v->map_band].write_pointer = i;
     v->seq = h->seq+1;
+    v->mount.tail_usecs = usecs_now() - t;
+    t = usecs_now();
     
     /* now read forward from earliest relevant record to the end of
      * the checkpointed map and band information. Set the volume base
      * accordingly.
      */
-    smr_read(v->disk, m, i, v->buf, 1);
     pba_t base = v->base = h->base;
     seq = h->seq;
     while (base.band != m || base.offset != i)
-        base = read_records(v, base);
+        base = read_records(v, &rd, base);
+    v->mount.reads += rd.reads;
+    v->mount.sectors += rd.sectors;
+    free(rd.buf);
+    v->mount.records_usecs = usecs_now() - t;
+    t = usecs_now();
 
     /* now we have the band map and the exception map as of the last
-     * checkpoint. For now assume that drive is properly checkpointed.
-     * In the future, log recovery proceeds in breadth-first / seq#
-     * order starting with the tail of all the bands marked 'current'.
+     * checkpoint. Roll forward anything written since then, in seq#
+     * order, starting from where each frontier was checkpointed.
      */
+    v->mount.rolled = chase_frontiers(v, seq);
+    v->mount.chase_usecs = usecs_now() - t;
+    t = usecs_now();
 
     /* recover the state of all of the band groups.
      */
     for (i = 0, j = 1+v->map_size; i < v->n_groups; i++) {
+        for (k = 0; k < N_FRONTIERS; k++)
+            v->groups[i].frontier[k] = -1;
         for (k = 0; k < v->group_size; j++, k++) {
             int type = v->band[j].type;
-            if (type == BAND_TYPE_FRONTIER)
-                v->groups[i].frontier = j;
+            if (IS_FRONTIER(type))
+                v->groups[i].frontier[type - BAND_TYPE_FRONTIER] = j;
             v->groups[i].count[type]++;
         }
     }
 
-    if (chase_frontiers(v))
+    /* the clean band list has to be in checkpoint order
+     */
+    int *order = malloc(v->n_bands * sizeof(int));
+    for (i = 1+v->map_size, j = 0; i < v->n_bands; i++)
+        if (!v->band[i].dirty)
+            order[j++] = i;
+    qsort_r(order, j, sizeof(int), ck_seq_cmp, v);
+    for (i = 0; i < j; i++)
+        band_clean_append(v, order[i]);
+    free(order);
+    if (v->band_head >= 0)
+        v->oldest_seq = v->band[v->band_head].ck_seq;
+    if (v->clean.head != NULL && v->clean.head->seq < v->oldest_seq)
+        v->oldest_seq = v->clean.head->seq;
+
+    if (v->mount.rolled > 0 || v->n_dirty_bands > 0)
         checkpoint_volume(v);
+    v->ck_last = v->seq;
+    v->mount.ck_usecs = usecs_now() - t;
+
+    /* band types weren't final while the map was loaded
+     */
+    for (i = 1+v->map_size; i < v->n_bands; i++)
+        band_rebucket(v, i);
+    v->mount.total_usecs = usecs_now() - t0;
     return v;
 }
 
+struct volume *init_volume(const char *dev)
+{
+    return init_volume_flags(dev, 0);
+}
+
 int64_t volume_size(struct volume *v)
 {
     return v->n_groups * v->group_span * SECTOR_SIZE;
 }
 
+/* the write amplification counters summed over all policies, for
+ * tools that only see stl_public.h
+ */
+void volume_stats(struct volume *v, struct volume_stats *s)
+{
+    int i;
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&v->map_lock);
+    for (i = 0; i < N_POLICIES; i++) {
+        s->data_sectors += v->wamp.data_sectors[i];
+        s->moved_sectors += v->wamp.moved_sectors[i];
+        s->disk_sectors += v->wamp.disk_sectors[i];
+    }
+    s->checkpoints = v->ck.checkpoints;
+    s->map_extents = stl_map_count(v->map);
+    pthread_mutex_unlock(&v->map_lock);
+}
+
+int volume_sim(struct volume *v, const char *params)
+{
+    return smr_sim(v->disk, params);
+}
+
+int64_t volume_sim_time(struct volume *v, struct sim_stats *st)
+{
+    return smr_sim_time(v->disk, st);
+}
+
 void delete_volume(struct volume *v)
 {
+    int g;
+    volume_cleaner(v, 0);
+    volume_batching(v, 0, 0);   /* flushes and frees batches */
+    volume_wcache(v, 0);        /*  and the staging cache */
+    volume_rcache(v, 0);
     stl_map_destroy(v->map);
     smr_close(v->disk);
     free(v->buf);
+    for (g = 0; g < v->n_groups; g++) {
+        free(v->groups[g].pkt_buf);
+        free(v->groups[g].seq.buf);
+        pthread_mutex_destroy(&v->groups[g].lock);
+    }
+    pthread_mutex_destroy(&v->map_lock);
+    pthread_mutex_destroy(&v->clean_lock);
+    pthread_cond_destroy(&v->clean_cv);
+    pthread_cond_destroy(&v->space_cv);
+    free(v->need_clean);
+    free(v->stalled);
+    free(v->dirty_bands);
+    free(v->map_seq);
+    free(v->ck_buf);
+    free(v->ck_recs);
     free(v->band);
     free(v->groups);
 }
 
 /* ---------- Cleaning ----------- */
 
-/* clean a single group. Returns true if cleaning was performed.
+/* Victim selection policies. Each returns a full band in group 'g'
+ * to clean, or -1; 'iters' is the number of passes so far in this
+ * call to clean_group. Called with map_lock held.
+ */
+
+/* greedy - fewest live sectors, straight from the utilization buckets
  */
-static int clean_group(struct volume *v, int g, int minfree, int prio)
+static int pick_greedy(struct volume *v, int g, int iters)
 {
-    int i, nfree, made_changes = 0, iters = 0;
-    int base = g * v->group_size + v->map_size + 1;
+    return emptiest_band(v, g);
+}
 
-    /* are there enough free bands?
-     */
-    for (i = nfree = 0; i < v->group_size; i++)
-        if (v->band[base+i].type == BAND_TYPE_FREE)
-            nfree++;
+/* LFS cost-benefit: maximize (1-u)*age/(1+u), where u is the fraction
+ * of the band that's live and age is how many sequence numbers ago
+ * it was last written. Cold bands get cleaned at higher utilization
+ * than hot ones, which are left to empty themselves.
+ */
+static int pick_cost_benefit(struct volume *v, int g, int iters)
+{
+    int i, b = 1 + v->map_size + g * v->group_size, best = -1;
+    double max_benefit = -1;
+    for (i = 0; i < v->group_size; i++, b++) {
+        if (v->band[b].type != BAND_TYPE_FULL)
+            continue;
+        double u = (double)v->band[b].live_sectors / v->band_size;
+        double age = (uint32_t)(v->seq - v->band[b].data_seq) + 1;
+        double benefit = (1 - u) * age / (1 + u);
+        if (benefit > max_benefit) {
+            max_benefit = benefit;
+            best = b;
+        }
+    }
+    return best;
+}
+
+/* seek-aware: cleaning cost is live sectors plus a seek per extent
+ * (capped at roughly one per track). Falls back to plain greedy after
+ * the first pass so that a band with lots of small extents can't
+ * keep getting skipped.
+ */
+#define SECTORS_PER_SEEK 128
+static int pick_seeks(struct volume *v, int g, int iters)
+{
+    int i, b = 1 + v->map_size + g * v->group_size, best = -1;
+    int min_cost = 0;
+    for (i = 0; i < v->group_size; i++, b++) {
+        if (v->band[b].type != BAND_TYPE_FULL)
+            continue;
+        int s = min(v->band[b].live_extents, 1 + v->band_size / 512);
+        if (iters > 1)
+            s = 0;
+        int cost = s*SECTORS_PER_SEEK + v->band[b].live_sectors;
+        if (best < 0 || cost < min_cost) {
+            min_cost = cost;
+            best = b;
+        }
+    }
+    return best;
+}
+
+static struct {
+    const char *name;
+    int (*pick)(struct volume *v, int g, int iters);
+} policies[N_POLICIES] = {
+    {.name = "greedy", .pick = pick_greedy},
+    {.name = "cost-benefit", .pick = pick_cost_benefit},
+    {.name = "seeks", .pick = pick_seeks},
+};
+
+/* select the cleaning policy by name. returns -1 if unknown
+ */
+int volume_policy(struct volume *v, const char *name)
+{
+    int i;
+    for (i = 0; i < N_POLICIES; i++)
+        if (!strcmp(name, policies[i].name)) {
+            pthread_mutex_lock(&v->map_lock);
+            v->policy = i;
+            pthread_mutex_unlock(&v->map_lock);
+            return 0;
+        }
+    return -1;
+}
+
+const char *volume_policy_name(int i)
+{
+    return (i >= 0 && i < N_POLICIES) ? policies[i].name : NULL;
+}
+
+/* number of write frontiers per group: 1 = everything together,
+ * 2 = separate band for cleaned data (default), 3 = and for data
+ * that's been cleaned more than once. Frontier bands for streams no
+ * longer in use stay allocated until they're turned back on.
+ * (sequential streams are controlled by volume_sequential)
+ */
+void volume_frontiers(struct volume *v, int n)
+{
+    assert(n >= 1 && n <= STREAM_SEQ);
+    pthread_mutex_lock(&v->map_lock);
+    v->n_frontiers = n;
+    pthread_mutex_unlock(&v->map_lock);
+}
 
-    while (v->groups[g].count[BAND_TYPE_FREE] <= minfree) {
+/* There are two levels of cleaning and band allocation.
+ * - background cleaning - clean until MINFREE_BG bands are free,
+ *   allocate extents at normal priority. (clean if 1 free)
+ * - forced cleaning - clean until MINFREE_PRIO bands are free,
+ *   allocate at high priority. (i.e. can allocate the last band that
+ *   is not touched by normal priority allocation)
+ */
+#define MINFREE_FG 2
+#define MINFREE_BG 4
+#define PRIO_NORM 0
+#define PRIO_HIGH 1
+
+/* free space in group 'g' in sectors: the free bands, plus the room
+ * left on its frontiers. With 2 or 3 streams the moved data can open a
+ * cleaner frontier band from the free bands, so a pass can free a band
+ * without count[BAND_TYPE_FREE] going up - but this always goes up
+ * unless the band cleaned was (nearly) all live data.
+ */
+static int group_free_sectors(struct volume *v, int g)
+{
+    struct group *gr = &v->groups[g];
+    int s, n = gr->count[BAND_TYPE_FREE] * v->band_size;
+    for (s = 0; s < N_FRONTIERS; s++)
+        if (gr->frontier[s] >= 0)
+            n += v->band_size - v->band[gr->frontier[s]].write_pointer;
+    return n;
+}
+
+/* clean a single group, at most 'passes' bands. Returns true if
+ * cleaning was performed. Stops early if a pass doesn't add to the
+ * group's free space, or if there aren't the free bands the moved
+ * data would need - the last would make alloc_extent clean inline,
+ * and pick the band being emptied.
+ */
+static int clean_group(struct volume *v, int g, int minfree, int prio,
+                       int passes)
+{
+    int i, made_changes = 0, iters = 0;
+    int reserve = prio ? 0 : MINFREE_FG;
+
+    while (v->groups[g].count[BAND_TYPE_FREE] <= minfree && iters < passes) {
         printf("CLEANING %d: free = %d iter %d\n", g,
                v->groups[g].count[BAND_TYPE_FREE], ++iters);
 	checkpoint_volume(v);
         made_changes = 1;
+        int before = group_free_sectors(v, g);
 
-        assert(iters < 10);
-
-        /* find the cleaning cost of each band, by counting:
-         * - total data (sectors) in band
-         * - approximate seeks to clean band (cap at ~#tracks/band)
-         */
-#define SECTORS_PER_SEEK 128
-        int *seeks = calloc(v->group_size * sizeof(int), 1);
-        int *sectors = calloc(v->group_size * sizeof(int), 1);
-        //int seeks[v->group_size], sectors[v->group_size];
-        //for (i = 0; i < v->group_size; i++)
-        //seeks[i] = sectors[i] = 0;
-
-        pba_t begin = mkpba(base, 0);
-        struct entry *e = stl_map_pba_geq(v->map, begin);
-
-        while (e != NULL && e->pba.band < base+v->group_size) {
-            i = e->pba.band - base;
-            assert(i >= 0 && i < v->group_size);
-            seeks[i]++;
-            sectors[i] += e->len;
-            e = stl_map_pba_iterate(v->map, e);
-        }
+        pthread_mutex_lock(&v->map_lock);
+        int band = policies[v->policy].pick(v, g, iters);
+        assert(band >= 0);
+        int stream = (v->band[band].stream == STREAM_HOST) ? STREAM_CLEAN : STREAM_OLD;
+        stream = min(stream, v->n_frontiers - 1);
 
-        /* mark all the free bands so we don't try to clean them
+        /* bands needed for the data, a header and trailer per packet,
+         * and the close-out header of a full frontier
          */
-        for (i = 0; i < v->group_size; i++)
-            if (v->band[i+base].type == BAND_TYPE_FREE ||
-                v->band[i+base].type == BAND_TYPE_FRONTIER)
-                sectors[i] = 1e9;
-
-        int min_cost = 1e9, min_band = -1;
-        for (i = 0; i < v->group_size; i++) {
-#if 0
-            int s = min(seeks[i], 1 + v->band_size / 512);
-            if (iters > 1)
-                s = 0;
-            int cost = s*SECTORS_PER_SEEK + sectors[i];
-#endif
-            int cost = sectors[i];
-            if (cost < min_cost) {
-                min_cost = cost;
-                min_band = i;
-            }
+        int f = v->groups[g].frontier[stream];
+        int room = (f < 0) ? 0 : v->band_size - v->band[f].write_pointer - 8;
+        int need = v->band[band].live_sectors + 1 +
+            2 * (v->band[band].live_extents / DATA_RECORDS + 2);
+        int bands = (need <= room) ? 0 : 1 + (need - max(room, 0)) / (v->band_size - 8);
+        if (v->groups[g].count[BAND_TYPE_FREE] - reserve < bands) {
+            pthread_mutex_unlock(&v->map_lock);
+            printf("CLEANING %d: no free band for %d sectors\n", g, need);
+            break;
         }
-        assert(min_band >= 0);
+        v->wamp.moved_sectors[v->policy] += v->band[band].live_sectors;
 
         /* read all the valid extents from this band
          */
-        int band = min_band + base, n_sectors = sectors[min_band];
-        int n_extents = seeks[min_band];
+        int n_sectors = v->band[band].live_sectors;
+        int n_extents = v->band[band].live_extents;
         void *buf = valloc(n_sectors * SECTOR_SIZE);
         int *len = calloc(n_extents * sizeof(int), 1);
         int64_t *lba = calloc(n_extents * sizeof(int64_t), 1);
@@ -512,64 +1270,278 @@ static int clean_group(struct volume *v, int g, int minfree, int prio)
         printf("PICKED %d - %d sectors\n", band, n_sectors);
 
         pba_t _pba[n_extents];
-        begin = mkpba(band, 0);
-        e = stl_map_pba_geq(v->map, begin);
+        struct entry *e = stl_map_pba_geq(v->map, mkpba(band, 0));
         for (i = 0; e != NULL && e->pba.band == band; i++) {
-            smr_read(v->disk, e->pba.band, e->pba.offset, ptr, e->len);
             len[i] = e->len;
             lba[i] = e->lba;
             _pba[i] = e->pba;
-            ptr += (e->len * SECTOR_SIZE);
             struct entry *tmp = stl_map_pba_iterate(v->map, e);
-            stl_map_remove(v->map, e);
+            band_live(v, e->pba, -e->len, -1);
+            entry_remove(v, e);
             e = tmp;
         }
+        assert(i == n_extents && v->band[band].live_sectors == 0);
+        pthread_mutex_unlock(&v->map_lock);
+
+        /* nobody else can touch this group's LBAs while we hold its
+         * lock, so the data stays put after dropping map_lock.
+         */
+        for (i = 0; i < n_extents; i++) {
+            smr_read_async(v->disk, _pba[i].band, _pba[i].offset, ptr, len[i]);
+            ptr += (len[i] * SECTOR_SIZE);
+        }
+        smr_wait(v->disk);
 
-        /* Now re-write them
+        /* Now re-write them, packing as many extents into each
+         * packet as the trailer has room for. (one packet per extent
+         * costs 2 sectors each, which can use up all the space freed)
          */
-        for (i = 0, ptr = buf; i < n_extents; i++) {
-            printf("moving %d from %d.%d\n", (int)lba[i], _pba[i].band,
-                   _pba[i].offset);
-            do_write(v, g, lba[i], ptr, len[i], prio);
-            ptr += len[i] * SECTOR_SIZE;
+        struct map_record recs[DATA_RECORDS];
+        for (i = 0, ptr = buf; i < n_extents; ) {
+            int n, _sectors;
+            for (n = _sectors = 0; n < DATA_RECORDS && i < n_extents; n++, i++) {
+                printf("moving %d from %d.%d\n", (int)lba[i], _pba[i].band,
+                       _pba[i].offset);
+                recs[n] = (struct map_record){.lba = lba[i], .len = len[i]};
+                _sectors += len[i];
+            }
+            write_records(v, g, stream, recs, n, ptr, prio);
+            ptr += _sectors * SECTOR_SIZE;
         }
 
+        pthread_mutex_lock(&v->map_lock);
         int type = v->band[band].type;
         v->groups[g].count[type]--;
         v->groups[g].count[BAND_TYPE_FREE]++;
         v->band[band].type = BAND_TYPE_FREE;
-        v->band[band].dirty = 1;
+        band_dirty(v, band);
         v->band[band].write_pointer = 0;
+        smr_reset_pointer(v->disk, band);
+        band_rebucket(v, band);
+        if (v->rcache != NULL)
+            rc_invalidate_band(v->rcache, band);
+        pthread_mutex_unlock(&v->map_lock);
 
         free(buf);
-        free(seeks); free(sectors);
         free(len); free(lba);
-        nfree++;
-    }
+
+        if (group_free_sectors(v, g) <= before) {
+            printf("CLEANING %d: no progress\n", g);
+            break;
+        }
+    }
     return made_changes;
 }
 
-/* There are two levels of cleaning and band allocation.
- * - background cleaning - clean until MINFREE_BG bands are free,
- *   allocate extents at normal priority. (clean if 1 free)
- * - forced cleaning - clean until MINFREE_PRIO bands are free,
- *   allocate at high priority. (i.e. can allocate the last band that
- *   is not touched by normal priority allocation)
- */
-#define MINFREE_FG 2
-#define MINFREE_BG 4
-#define PRIO_NORM 0
-#define PRIO_HIGH 1
-
 void clean_all(struct volume *v)
 {
     int g, dirty;
-    for (g = dirty = 0; g < v->n_groups; g++)
-        dirty = dirty || clean_group(v, g, MINFREE_BG, PRIO_NORM);
+    for (g = dirty = 0; g < v->n_groups; g++) {
+        pthread_mutex_lock(&v->groups[g].lock);
+        dirty = clean_group(v, g, MINFREE_BG, PRIO_NORM, v->group_size) || dirty;
+        pthread_mutex_unlock(&v->groups[g].lock);
+    }
     if (dirty)
         checkpoint_volume(v);
 }
 
+/*------------ Background cleaning -----------*/
+
+/* The cleaner thread keeps each group above MINFREE_BG free bands so
+ * that host writes don't have to clean inline (notes 4/22/15):
+ * - a writer that takes a band and leaves MINFREE_BG or fewer free
+ *   flags the group in v->need_clean and signals clean_cv.
+ * - a write to a group with MINFREE_FG or fewer free bands drops the
+ *   group lock and waits on space_cv until the cleaner makes room.
+ * - the cleaner frees one band per wakeup under the group lock,
+ *   cleaning at most CLEAN_PASSES bands, so writes to the group
+ *   interleave with cleaning. When idle it checks all groups every
+ *   CLEAN_IDLE_SECS.
+ * - a group where cleaning gains no space stays flagged but is marked
+ *   stalled, and skipped until CLEAN_IDLE_SECS have passed. Writers
+ *   waiting on it are woken, and go on to clean in the foreground.
+ * - while idle it also wakes every batch_usecs (or SEQ_USECS) to
+ *   write out group commit batches and staged streams that have
+ *   timed out, since otherwise nothing looks at them until the next
+ *   request.
+ * If the cleaner isn't running, or one write uses up the reserve,
+ * alloc_extent still does forced cleaning in the foreground.
+ */
+#define CLEAN_IDLE_SECS 1
+#define CLEAN_PASSES    4
+#define CLEAN_TICK_USECS 1000   /* shortest idle wait */
+
+#define group_bit(g) (1ULL << ((g) % 64))
+
+/* called without clean_lock
+ */
+static void kick_cleaner(struct volume *v, int g)
+{
+    pthread_mutex_lock(&v->clean_lock);
+    v->need_clean[g/64] |= group_bit(g);
+    pthread_cond_signal(&v->clean_cv);
+    pthread_mutex_unlock(&v->clean_lock);
+}
+
+/* pick a flagged group that isn't stalled and clear its flag. Called
+ * with clean_lock.
+ */
+static int next_flagged(struct volume *v)
+{
+    int g;
+    for (g = 0; g < v->n_groups; g++)
+        if (v->need_clean[g/64] & ~v->stalled[g/64] & group_bit(g)) {
+            v->need_clean[g/64] &= ~group_bit(g);
+            return g;
+        }
+    return -1;
+}
+
+static void *cleaner_thread(void *arg)
+{
+    struct volume *v = arg;
+    int g;
+    int64_t stalled_at = 0, scanned_at = usecs_now();
+
+    pthread_mutex_lock(&v->clean_lock);
+    while (!v->cleaner_stop) {
+        /* give stalled groups another try now and then - TRIMs or
+         * overwrites may have emptied some bands since
+         */
+        if (stalled_at && usecs_now() - stalled_at > CLEAN_IDLE_SECS * 1000000) {
+            memset(v->stalled, 0, (v->n_groups + 63) / 64 * sizeof(uint64_t));
+            stalled_at = 0;
+        }
+        if ((g = next_flagged(v)) < 0) {
+            int64_t wait = CLEAN_IDLE_SECS * 1000000LL;
+            if (v->batch_sectors > 0)
+                wait = min(wait, v->batch_usecs);
+            if (v->seq_sectors > 0)
+                wait = min(wait, SEQ_USECS);
+            wait = max(wait, CLEAN_TICK_USECS);
+
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            wait += ts.tv_nsec / 1000;
+            ts.tv_sec += wait / 1000000;
+            ts.tv_nsec = (wait % 1000000) * 1000;
+            if (pthread_cond_timedwait(&v->clean_cv, &v->clean_lock,
+                                       &ts) != ETIMEDOUT)
+                continue;
+            pthread_mutex_unlock(&v->clean_lock);
+            batch_expire(v);
+            pthread_mutex_lock(&v->clean_lock);
+            if (usecs_now() - scanned_at < CLEAN_IDLE_SECS * 1000000LL)
+                continue;
+            scanned_at = usecs_now();
+
+            /* idle - skip busy groups, writers will flag them
+             */
+            for (g = 0; g < v->n_groups; g++) {
+                if (pthread_mutex_trylock(&v->groups[g].lock) != 0)
+                    continue;
+                if (v->groups[g].count[BAND_TYPE_FREE] <= MINFREE_BG)
+                    v->need_clean[g/64] |= group_bit(g);
+                pthread_mutex_unlock(&v->groups[g].lock);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&v->clean_lock);
+
+        struct group *gr = &v->groups[g];
+        pthread_mutex_lock(&gr->lock);
+        int nfree = gr->count[BAND_TYPE_FREE], more = 0, stuck = 0;
+        /* writers can leave the group at MINFREE_FG, so the moved data
+         * has to be allowed the reserve - otherwise alloc_extent
+         * cleans inline and picks the band we're emptying again.
+         */
+        if (nfree <= MINFREE_BG) {
+            int before = group_free_sectors(v, g);
+            clean_group(v, g, nfree, PRIO_HIGH, CLEAN_PASSES); /* one more free band */
+            stuck = (group_free_sectors(v, g) <= before);
+            more = (gr->count[BAND_TYPE_FREE] <= MINFREE_BG);
+        }
+        pthread_mutex_unlock(&gr->lock);
+
+        pthread_mutex_lock(&v->clean_lock);
+        if (nfree <= MINFREE_BG)
+            v->stats.n_bg_cleans++;
+        if (more)
+            v->need_clean[g/64] |= group_bit(g);
+        if (stuck) {
+            v->stalled[g/64] |= group_bit(g);
+            v->stats.n_stalls++;
+            if (!stalled_at)
+                stalled_at = usecs_now();
+        }
+        pthread_cond_broadcast(&v->space_cv);
+    }
+    pthread_mutex_unlock(&v->clean_lock);
+    return NULL;
+}
+
+/* called by host writes with the group lock held, and returns with it
+ * held. Blocks while the group is at the MINFREE_FG floor and the
+ * cleaner is running, unless the cleaner has given up on the group -
+ * then the write cleans for itself in alloc_extent.
+ */
+static void wait_for_space(struct volume *v, int g)
+{
+    struct group *gr = &v->groups[g];
+    if (!v->cleaner_on || gr->count[BAND_TYPE_FREE] > MINFREE_FG)
+        return;
+
+    int64_t t0 = usecs_now();
+    while (gr->count[BAND_TYPE_FREE] <= MINFREE_FG) {
+        pthread_mutex_unlock(&gr->lock);
+        pthread_mutex_lock(&v->clean_lock);
+        int on = v->cleaner_on && !(v->stalled[g/64] & group_bit(g));
+        if (on) {
+            v->need_clean[g/64] |= group_bit(g);
+            pthread_cond_signal(&v->clean_cv);
+            pthread_cond_wait(&v->space_cv, &v->clean_lock);
+        }
+        pthread_mutex_unlock(&v->clean_lock);
+        pthread_mutex_lock(&gr->lock);
+        if (!on)
+            break;
+    }
+
+    int64_t t = usecs_now() - t0;
+    pthread_mutex_lock(&v->clean_lock);
+    v->stats.n_waits++;
+    v->stats.wait_usecs += t;
+    v->stats.max_wait_usecs = max(v->stats.max_wait_usecs, t);
+    pthread_mutex_unlock(&v->clean_lock);
+}
+
+/* start (on != 0) or stop the cleaner thread.
+ */
+void volume_cleaner(struct volume *v, int on)
+{
+    pthread_mutex_lock(&v->clean_lock);
+    if (!on == !v->cleaner_on) {
+        pthread_mutex_unlock(&v->clean_lock);
+        return;
+    }
+    if (on) {
+        v->cleaner_on = 1;
+        v->cleaner_stop = 0;
+        pthread_mutex_unlock(&v->clean_lock);
+        pthread_create(&v->cleaner, NULL, cleaner_thread, v);
+        return;
+    }
+    v->cleaner_stop = 1;
+    pthread_cond_signal(&v->clean_cv);
+    pthread_mutex_unlock(&v->clean_lock);
+    pthread_join(v->cleaner, NULL);
+
+    pthread_mutex_lock(&v->clean_lock);
+    v->cleaner_on = 0;
+    pthread_cond_broadcast(&v->space_cv); /* waiters clean for themselves */
+    pthread_mutex_unlock(&v->clean_lock);
+}
+
 /*------------ Write, allocate -----------*/
 
 /* Find a free band in group 'g'.
@@ -589,16 +1561,16 @@ static int find_free_band(struct volume *v, int g, int prio)
     return -1;
 }
 
-/* assemble the header for a write packet into v->buf and write it at
- * the head of 'band'. Updates sequence#.
+/* assemble the header for a write packet into 'buf'. Updates sequence#.
  * use the same header (with modifications to 'prev' and 'next') at tail.
+ * Caller holds map_lock.
  */
-static void do_write_hdr(struct volume *v, pba_t here, pba_t prev,
-                  pba_t next, int band, void *map, int n_records)
+static void mk_data_hdr(struct volume *v, void *buf, pba_t here, pba_t prev,
+                        pba_t next, int band, void *map, int n_records)
 {
     v->band[band].seq = v->seq;
-    memset(v->buf, 0, SECTOR_SIZE);
-    struct header *h = v->buf;
+    memset(buf, 0, SECTOR_SIZE);
+    struct header *h = buf;
     printf("do_write_hdr: %d.%d (%d.%d)\n", here.band, here.offset,
            next.band, next.offset);
     *h = (struct header){.magic = STL_MAGIC, .seq = v->seq++,
@@ -606,50 +1578,93 @@ static void do_write_hdr(struct volume *v, pba_t here, pba_t prev,
                          .records = 0, .prev = prev, .next = next,
                          .base = v->base};
     memcpy(h+1, map, sizeof(struct map_record)*n_records);
-    smr_write(v->disk, here.band, here.offset, h, 1);
+    hdr_seal(v->nonce, h);
+}
+
+/* assemble a header in 'buf' and write it at 'here'
+ */
+static void do_write_hdr(struct volume *v, void *buf, pba_t here, pba_t prev,
+                  pba_t next, int band, void *map, int n_records)
+{
+    pthread_mutex_lock(&v->map_lock);
+    mk_data_hdr(v, buf, here, prev, next, band, map, n_records);
+    v->wamp.disk_sectors[v->policy]++;
+    pthread_mutex_unlock(&v->map_lock);
+    smr_write(v->disk, here.band, here.offset, buf, 1);
 }
 
-/* allocate a PBA extent. Updates the band map by advancing the write
- * pointer by 'len' sectors, marking it dirty, and setting sequence
- * number. Priority is passed down to find_free_band to avoid deadlock
- * on forced cleaning.
+/* allocate a PBA extent on the frontier for 'stream', starting a
+ * new frontier band if there's no room (or the stream hasn't been
+ * used yet). Updates the band map by advancing the write pointer by
+ * 'len' sectors, marking it dirty, and setting sequence number.
+ * Priority is passed down to find_free_band to avoid deadlock on
+ * forced cleaning.
  */
-static pba_t alloc_extent(struct volume *v, int g, int len, 
+static pba_t alloc_extent(struct volume *v, int g, int stream, int len,
                     int prio, int *plen)
 {
     struct group *gr = v->groups + g;
     int left, b;
 top:
-    b = gr->frontier;
-    left = v->band_size - v->band[b].write_pointer;
-    pba_t here = {.band = b, .offset = v->band[b].write_pointer};
+    b = gr->frontier[stream];
+    left = (b < 0) ? 0 : v->band_size - v->band[b].write_pointer;
+    pba_t here = {.band = b, .offset = (b < 0) ? 0 : v->band[b].write_pointer};
     if (left < 8) {
-        pba_t prev = {.band = b, .offset = v->band[b].write_pointer-1};
         int b2 = find_free_band(v, g, prio);
         if (b2 == -1) {
-            if (clean_group(v, g, MINFREE_FG, PRIO_HIGH))
+            int64_t t0 = usecs_now();
+            int before = group_free_sectors(v, g);
+            if (clean_group(v, g, MINFREE_FG, PRIO_HIGH, v->group_size))
                 checkpoint_volume(v);
-            goto top;
+            int64_t t = usecs_now() - t0;
+            pthread_mutex_lock(&v->clean_lock);
+            v->stats.n_fg_cleans++;
+            v->stats.fg_usecs += t;
+            v->stats.max_fg_usecs = max(v->stats.max_fg_usecs, t);
+            pthread_mutex_unlock(&v->clean_lock);
+            if (group_free_sectors(v, g) > before)
+                goto top;
+            /* cleaning can't gain anything - dip into the reserve, and
+             * if that's gone the group really is full
+             */
+            b2 = find_free_band(v, g, PRIO_HIGH);
+            if (b2 == -1)
+                printf("group %d is full\n", g);
         }
         assert(b2 != -1);
         gr->count[BAND_TYPE_FREE]--;
         assert(v->band[b2].write_pointer == 0);
         pba_t next = {.band = b2, .offset = 0};
 
-        gr->count[BAND_TYPE_FULL]++;
-        v->band[b].type = BAND_TYPE_FULL;
-        v->band[b].dirty = 1;
-        v->band[b].write_pointer++;
-        v->band[b].seq = v->seq;
-
-        do_write_hdr(v, here, prev, next, 0, 0, 0); /* increments v->seq */
+        /* close out the old band with a pointer to the new one
+         */
+        if (b >= 0) {
+            pba_t prev = {.band = b, .offset = v->band[b].write_pointer-1};
+            pthread_mutex_lock(&v->map_lock);
+            gr->count[v->band[b].type]--;
+            gr->count[BAND_TYPE_FULL]++;
+            v->band[b].type = BAND_TYPE_FULL;
+            band_dirty(v, b);
+            v->band[b].write_pointer++;
+            v->band[b].seq = v->seq;
+            band_rebucket(v, b);
+            pthread_mutex_unlock(&v->map_lock);
+
+            do_write_hdr(v, gr->pkt_buf, here, prev, next, 0, 0, 0); /* increments v->seq */
+        }
 
-        v->band[b2].type = BAND_TYPE_FRONTIER;
-        v->band[b2].dirty = 1;
+        pthread_mutex_lock(&v->map_lock);
+        gr->count[FRONTIER_TYPE(stream)]++;
+        v->band[b2].type = FRONTIER_TYPE(stream);
+        v->band[b2].stream = stream;
+        band_dirty(v, b2);
         v->band[b2].seq = v->seq;
+        pthread_mutex_unlock(&v->map_lock);
 
-        gr->frontier = b2;
+        gr->frontier[stream] = b2;
         b = b2;
+        if (v->cleaner_on && gr->count[BAND_TYPE_FREE] <= MINFREE_BG)
+            kick_cleaner(v, g);
         here = next;
         left = v->band_size;
         //checkpoint_volume(v);
@@ -663,53 +1678,547 @@ top:
     return here;
 }
 
-#warning FIXME: fix to work better with writev / aio
-
-/* actually perform a write, wrapped with DATA records. 'prio' is used
- * to ensure that writes for forced cleaning can grab the last free
- * band.
- *
- * TODO - have alloc_extent return a length, and iterate. That way we
- * don't wast space at the end of a band.
+/* actually perform a write, wrapped with DATA records. 'recs' gives
+ * the LBA and length of each of 'n' extents, whose data is packed
+ * back-to-back in 'buf'. They go out as a single header/data/trailer
+ * packet, or as several if the frontier band fills up, on the
+ * frontier for 'stream'. 'prio' is used to ensure that writes for
+ * forced cleaning can grab the last free band.
  */
-static void do_write(struct volume *v, int group, lba_t lba,
-                     const void *buf, int sectors, int prio)
+static void write_records(struct volume *v, int group, int stream,
+                          struct map_record *recs, int n, const void *buf,
+                          int prio)
 {
-    int alloced = 0;
+    int i, j, sectors, alloced = 0, done = 0;
+    struct map_record map[DATA_RECORDS];
+    struct group *gr = v->groups + group;
+
+    assert(n <= DATA_RECORDS);
+    for (i = sectors = 0; i < n; i++)
+        sectors += recs[i].len;
+
+    i = 0;
     while (sectors > 0) {
-        pba_t pba = alloc_extent(v, group, sectors+2, prio, &alloced);
-        int _sectors = alloced-2;
-        struct map_record map = {.lba = lba, .pba = pba_add(pba,1),
-                                 .len = _sectors};
+        pba_t pba = alloc_extent(v, group, stream, sectors+2, prio, &alloced);
+        int m, _sectors = alloced-2;
+        pba_t ptr = pba_add(pba, 1);
 
-        /* map entries haven't been logged yet, so location=PBA_NULL
+        /* fill the extent with as many records as fit; the last
+         * one may be split across packets.
          */
-        update_range(v, PBA_NULL, lba, _sectors, pba_add(pba, 1), v->seq);
-
-        do_write_hdr(v,
-                     pba,                      /* location */
-                     pba_add(pba, -1),         /* prev */
-                     pba_add(pba, _sectors+1), /* next */
-                     pba.band,
-                     0, 0);                    /* no map entry */
-        smr_write(v->disk, pba.band, pba.offset+1, buf, _sectors);
-        do_write_hdr(v,
-                     pba_add(pba, 1+_sectors),    /* location */
-                     pba,                         /* prev */
-                     pba_add(pba, _sectors+2),    /* next */
-                     pba.band,
-                     &map, 1);                    /* one map entry */
+        for (m = 0; ptr.offset < pba.offset+1+_sectors; m++) {
+            int len = min(recs[i].len - done, pba.offset+1+_sectors - ptr.offset);
+            map[m] = (struct map_record){.lba = recs[i].lba + done,
+                                         .pba = ptr, .len = len};
+            ptr = pba_add(ptr, len);
+            if ((done += len) == recs[i].len) {
+                i++;
+                done = 0;
+            }
+        }
 
+        /* header, data and trailer go out in a single write
+         */
+        void *hdr = gr->pkt_buf, *trailer = gr->pkt_buf + SECTOR_SIZE;
+        pthread_mutex_lock(&v->map_lock);
+        uint32_t seq = v->seq;
+        mk_data_hdr(v, hdr,
+                    pba,                      /* location */
+                    pba_add(pba, -1),         /* prev */
+                    pba_add(pba, _sectors+1), /* next */
+                    pba.band,
+                    0, 0);                    /* no map entry */
+        mk_data_hdr(v, trailer,
+                    pba_add(pba, 1+_sectors),    /* location */
+                    pba,                         /* prev */
+                    pba_add(pba, _sectors+2),    /* next */
+                    pba.band,
+                    map, m);                     /* map entries */
+        pthread_mutex_unlock(&v->map_lock);
+        struct iovec iov[3] = {
+            {.iov_base = hdr, .iov_len = SECTOR_SIZE},
+            {.iov_base = (void*)buf, .iov_len = _sectors * SECTOR_SIZE},
+            {.iov_base = trailer, .iov_len = SECTOR_SIZE}};
+        smr_writev(v->disk, pba.band, pba.offset, iov, 3);
+
+        /* the map only points at the data once it's on disk, so a
+         * checkpoint from another group never logs unwritten extents.
+         * map entries haven't been logged yet, so location=PBA_NULL
+         */
+        pthread_mutex_lock(&v->map_lock);
+        for (j = 0; j < m; j++)
+            update_range(v, PBA_NULL, map[j].lba, map[j].len, map[j].pba, seq);
         v->band[pba.band].write_pointer += alloced;
-        v->band[pba.band].dirty = 1;
+        band_dirty(v, pba.band);
         v->band[pba.band].seq = v->seq;
+        v->band[pba.band].data_seq = seq;
+        v->wamp.data_sectors[v->policy] += _sectors;
+        v->wamp.disk_sectors[v->policy] += alloced;
+        pthread_mutex_unlock(&v->map_lock);
 
         sectors -= _sectors;
-        lba += _sectors;
         buf += _sectors * SECTOR_SIZE;
     }
 }
 
+static void do_write(struct volume *v, int group, lba_t lba,
+                     const void *buf, int sectors, int prio)
+{
+    struct map_record rec = {.lba = lba, .len = sectors};
+    write_records(v, group, STREAM_HOST, &rec, 1, buf, prio);
+}
+
+/*------------ Group commit -----------*/
+
+/* With batching on, small host writes to a group are queued and go
+ * out together in one packet, so N writes cost N+2 sectors instead of
+ * 3N. A batch is written when it fills up, when it's older than
+ * batch_usecs (checked on each host operation, and by the cleaner
+ * thread while it's idle), before any read or TRIM that overlaps it,
+ * and on host_flush.
+ */
+static int64_t usecs_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* batches and staged streams age by the modeled drive's clock when
+ * there is one, so that simulated runs repeat exactly
+ */
+static int64_t batch_clock(struct volume *v)
+{
+    int64_t t = smr_sim_time(v->disk, NULL);
+    return (t < 0) ? usecs_now() : t / 1000;
+}
+
+static void batch_flush(struct volume *v, int g)
+{
+    struct batch *b = &v->groups[g].batch;
+    if (b->n_records == 0)
+        return;
+    write_records(v, g, STREAM_HOST, b->map, b->n_records, b->buf, PRIO_NORM);
+    b->n_records = b->sectors = 0;
+}
+
+static int batch_overlaps(struct batch *b, lba_t lba, int sectors)
+{
+    return b->sectors > 0 && b->lo < lba + sectors && lba < b->hi;
+}
+
+static void seq_flush(struct volume *v, int g);
+
+/* flush any batched or staged sequential writes overlapping
+ * lba..+sectors. Caller holds the lock for every group in the range.
+ */
+static void batch_flush_range(struct volume *v, lba_t lba, int sectors)
+{
+    int g;
+    if (v->batch_sectors == 0 && v->seq_sectors == 0)
+        return;
+    for (g = lba / v->group_span; g < v->n_groups &&
+             g * (lba_t)v->group_span < lba + sectors; g++) {
+        if (batch_overlaps(&v->groups[g].batch, lba, sectors))
+            batch_flush(v, g);
+        if (batch_overlaps(&v->groups[g].seq, lba, sectors))
+            seq_flush(v, g);
+    }
+}
+
+/* called without holding any group lock. Busy groups are skipped -
+ * their batches get checked again on the next request or cleaner tick.
+ */
+static void batch_expire(struct volume *v)
+{
+    int g;
+    if (v->batch_sectors == 0 && v->seq_sectors == 0)
+        return;
+    int64_t now = batch_clock(v);
+    for (g = 0; g < v->n_groups; g++) {
+        if (pthread_mutex_trylock(&v->groups[g].lock) != 0)
+            continue;
+        if (v->groups[g].batch.n_records > 0 &&
+            now - v->groups[g].batch.start >= v->batch_usecs)
+            batch_flush(v, g);
+        if (v->groups[g].seq.sectors > 0 &&
+            now - v->groups[g].seq.start >= SEQ_USECS)
+            seq_flush(v, g);
+        pthread_mutex_unlock(&v->groups[g].lock);
+    }
+}
+
+static void batch_write(struct volume *v, int g, lba_t lba,
+                        const void *buf, int sectors)
+{
+    struct batch *b = &v->groups[g].batch;
+
+    if (b->n_records == DATA_RECORDS ||
+        b->sectors + sectors > v->batch_sectors)
+        batch_flush(v, g);
+
+    /* big writes don't gain anything from batching
+     */
+    if (sectors >= v->batch_sectors) {
+        do_write(v, g, lba, buf, sectors, PRIO_NORM);
+        return;
+    }
+
+    if (b->n_records == 0) {
+        b->lo = lba;
+        b->hi = lba + sectors;
+        b->start = batch_clock(v);
+    }
+    memcpy(b->buf + (int64_t)b->sectors * SECTOR_SIZE, buf,
+           (int64_t)sectors * SECTOR_SIZE);
+    b->map[b->n_records++] = (struct map_record){.lba = lba, .len = sectors};
+    b->sectors += sectors;
+    b->lo = min(b->lo, lba);
+    b->hi = max(b->hi, lba + sectors);
+}
+
+/*------------ Sequential streams -----------*/
+
+/* Each group remembers where its last write ended; once seq_sectors
+ * have been written in a row without a break, further writes in the
+ * run go to the STREAM_SEQ frontier instead of being interleaved
+ * with random traffic. They're staged in gr->seq until they fill the
+ * rest of the frontier band (up to SEQ_MAX_SECTORS), so a band of
+ * stream data is one header, LBA-contiguous data, one trailer - a
+ * single map extent, and a single physical read to get it back.
+ * Staged data goes out on the same triggers as a group commit batch,
+ * with SEQ_USECS as the timeout.
+ */
+/* staged sectors that will exactly fill the current STREAM_SEQ
+ * frontier band. alloc_extent leaves room for the closing header
+ * and starts a new band when less than 8 sectors are left.
+ */
+static int seq_room(struct volume *v, int g)
+{
+    int b = v->groups[g].frontier[STREAM_SEQ];
+    int max = min(SEQ_MAX_SECTORS, v->band_size - 4);
+    int left = (b < 0) ? 0 : v->band_size - v->band[b].write_pointer;
+    return (left < 8) ? max : min(max, left - 4);
+}
+
+static void seq_flush(struct volume *v, int g)
+{
+    struct batch *s = &v->groups[g].seq;
+    if (s->sectors == 0)
+        return;
+    struct map_record rec = {.lba = s->lo, .len = s->sectors};
+    write_records(v, g, STREAM_SEQ, &rec, 1, s->buf, PRIO_NORM);
+    s->sectors = 0;
+}
+
+/* is a write at lba..+sectors part of a sequential stream? Only if
+ * it continues a run that was already seq_sectors long - a single
+ * large write on its own is just written.
+ */
+static int seq_detect(struct volume *v, int g, lba_t lba, int sectors)
+{
+    struct group *gr = &v->groups[g];
+    int run = (lba == gr->seq_next) ? gr->seq_run : 0;
+    gr->seq_run = run + sectors;
+    gr->seq_next = lba + sectors;
+    return v->seq_sectors > 0 && run >= v->seq_sectors;
+}
+
+static void seq_write(struct volume *v, int g, lba_t lba,
+                      const void *buf, int sectors)
+{
+    struct batch *s = &v->groups[g].seq;
+
+    if (s->buf == NULL)
+        s->buf = valloc(min(SEQ_MAX_SECTORS, v->band_size) * SECTOR_SIZE);
+    if (s->sectors > 0 && lba != s->hi)
+        seq_flush(v, g);
+
+    while (sectors > 0) {
+        int room = seq_room(v, g);
+        if (s->sectors == 0) {
+            s->lo = s->hi = lba;
+            s->start = batch_clock(v);
+        }
+        int n = min(sectors, room - s->sectors);
+        memcpy(s->buf + (int64_t)s->sectors * SECTOR_SIZE, buf,
+               (int64_t)n * SECTOR_SIZE);
+        s->sectors += n;
+        s->hi += n;
+        if (s->sectors == room)
+            seq_flush(v, g);
+        lba += n;
+        sectors -= n;
+        buf += n * SECTOR_SIZE;
+    }
+}
+
+/* sequential streams are detected after 'kbytes' of contiguous
+ * writes to a group; 0 turns detection off.
+ */
+void volume_sequential(struct volume *v, int kbytes)
+{
+    host_flush(v);
+    v->seq_sectors = kbytes * 1024 / SECTOR_SIZE;
+}
+
+/*------------ Write-back staging cache -----------*/
+
+/* With the staging cache on (volume_wcache), small host writes are
+ * copied into a per-group RAM cache instead of going to the disk, so
+ * a sector that's rewritten over and over costs one write when the
+ * cache drains. Reads check the cache after reading the disk. The
+ * cache drains in LBA order - runs of consecutive sectors become a
+ * single record, packed DATA_RECORDS to a packet - when it fills,
+ * on host_flush, and before the periodic checkpoint in host_write.
+ * Bigger writes, and sequential streams, go around it and discard
+ * any cached copies of their sectors; TRIM does the same.
+ */
+#define WCACHE_MAX_WRITE 64     /* sectors */
+
+static int wcache_hash(struct wcache *c, lba_t lba)
+{
+    return (lba * 2654435761ULL) & (c->hsize - 1);
+}
+
+/* slot holding 'lba', or -1. With 'add', take a new slot if it
+ * isn't there - caller makes sure there's room.
+ */
+static int wcache_slot(struct wcache *c, lba_t lba, int add)
+{
+    int h = wcache_hash(c, lba);
+    while (c->hash[h] != 0) {
+        int i = c->hash[h] - 1;
+        if (c->lba[i] == lba)
+            return i;
+        h = (h + 1) & (c->hsize - 1);
+    }
+    if (!add)
+        return -1;
+    c->lba[c->n] = lba;
+    c->hash[h] = ++c->n;
+    return c->n - 1;
+}
+
+static int wcache_overlaps(struct wcache *c, lba_t lba, int sectors)
+{
+    return c->n > 0 && c->lo < lba + sectors && lba < c->hi;
+}
+
+struct wcache_sort {
+    lba_t lba;
+    int   slot;
+};
+
+static int wcache_cmp(const void *a, const void *b)
+{
+    const struct wcache_sort *s1 = a, *s2 = b;
+    return (s1->lba > s2->lba) - (s1->lba < s2->lba);
+}
+
+static void wcache_drain(struct volume *v, int g)
+{
+    struct wcache *c = &v->groups[g].wcache;
+    struct map_record recs[DATA_RECORDS];
+    int i, j, m, n, extents = 0;
+
+    if (c->n == 0)
+        return;
+    struct wcache_sort *s = malloc(c->n * sizeof(*s));
+    for (i = n = 0; i < c->n; i++)
+        if (c->lba[i] >= 0)
+            s[n++] = (struct wcache_sort){.lba = c->lba[i], .slot = i};
+    qsort(s, n, sizeof(*s), wcache_cmp);
+
+    void *buf = valloc(max(n, 1) * SECTOR_SIZE), *ptr = buf;
+    for (i = 0; i < n; i++)
+        memcpy(buf + (int64_t)i * SECTOR_SIZE,
+               c->buf + (int64_t)s[i].slot * SECTOR_SIZE, SECTOR_SIZE);
+
+    for (i = 0; i < n; ) {
+        int sectors = 0;
+        for (m = 0; m < DATA_RECORDS && i < n; m++, i = j) {
+            for (j = i+1; j < n && s[j].lba == s[j-1].lba + 1; j++)
+                ;
+            recs[m] = (struct map_record){.lba = s[i].lba, .len = j - i};
+            sectors += j - i;
+        }
+        write_records(v, g, STREAM_HOST, recs, m, ptr, PRIO_NORM);
+        ptr += (int64_t)sectors * SECTOR_SIZE;
+        extents += m;
+    }
+    free(buf);
+    free(s);
+
+    c->n = 0;
+    memset(c->hash, 0, c->hsize * sizeof(int));
+    pthread_mutex_lock(&v->map_lock);
+    v->wc.drained += n;
+    v->wc.extents += extents;
+    pthread_mutex_unlock(&v->map_lock);
+}
+
+static void wcache_write(struct volume *v, int g, lba_t lba,
+                         const void *buf, int sectors)
+{
+    struct wcache *c = &v->groups[g].wcache;
+    int i, absorbed = 0;
+
+    if (c->n + sectors > c->max)
+        wcache_drain(v, g);
+    if (c->n == 0) {
+        c->lo = lba;
+        c->hi = lba + sectors;
+    }
+    for (i = 0; i < sectors; i++) {
+        int n = c->n, slot = wcache_slot(c, lba + i, 1);
+        absorbed += (c->n == n);
+        memcpy(c->buf + (int64_t)slot * SECTOR_SIZE,
+               buf + (int64_t)i * SECTOR_SIZE, SECTOR_SIZE);
+    }
+    c->lo = min(c->lo, lba);
+    c->hi = max(c->hi, lba + sectors);
+
+    pthread_mutex_lock(&v->map_lock);
+    v->wc.writes += sectors;
+    v->wc.absorbed += absorbed;
+    pthread_mutex_unlock(&v->map_lock);
+}
+
+/* drop cached copies of lba..+sectors, which are being overwritten
+ * or trimmed
+ */
+static void wcache_discard(struct volume *v, int g, lba_t lba, int sectors)
+{
+    struct wcache *c = &v->groups[g].wcache;
+    int i, slot;
+    if (!wcache_overlaps(c, lba, sectors))
+        return;
+    if (sectors < c->n) {
+        for (i = 0; i < sectors; i++)
+            if ((slot = wcache_slot(c, lba + i, 0)) >= 0)
+                c->lba[slot] = -1;
+    }
+    else {
+        for (i = 0; i < c->n; i++)
+            if (c->lba[i] >= lba && c->lba[i] < lba + sectors)
+                c->lba[i] = -1;
+    }
+}
+
+/* copy any cached sectors of lba..+sectors over what was read from
+ * disk (or with buf = NULL, just count them). Returns the number found.
+ */
+static int wcache_read(struct volume *v, int g, lba_t lba, void *buf,
+                       int sectors)
+{
+    struct wcache *c = &v->groups[g].wcache;
+    int i, slot, hits = 0;
+    if (!wcache_overlaps(c, lba, sectors))
+        return 0;
+    for (i = 0; i < sectors; i++)
+        if ((slot = wcache_slot(c, lba + i, 0)) >= 0) {
+            if (buf != NULL)
+                memcpy(buf + (int64_t)i * SECTOR_SIZE,
+                       c->buf + (int64_t)slot * SECTOR_SIZE, SECTOR_SIZE);
+            hits++;
+        }
+    return hits;
+}
+
+static void wcache_drain_all(struct volume *v)
+{
+    int g;
+    for (g = 0; g < v->n_groups; g++) {
+        pthread_mutex_lock(&v->groups[g].lock);
+        wcache_drain(v, g);
+        pthread_mutex_unlock(&v->groups[g].lock);
+    }
+}
+
+/* staging cache of 'mbytes' in total, split evenly between groups.
+ * 0 turns it off.
+ */
+void volume_wcache(struct volume *v, int mbytes)
+{
+    int g;
+    host_flush(v);
+    for (g = 0; g < v->n_groups; g++) {
+        struct wcache *c = &v->groups[g].wcache;
+        free(c->lba);
+        free(c->buf);
+        free(c->hash);
+        memset(c, 0, sizeof(*c));
+    }
+    v->wcache_sectors = (int64_t)mbytes * 1024 * 1024 / SECTOR_SIZE / v->n_groups;
+    if (v->wcache_sectors == 0)
+        return;
+    for (g = 0; g < v->n_groups; g++) {
+        struct wcache *c = &v->groups[g].wcache;
+        c->max = v->wcache_sectors;
+        for (c->hsize = 1; c->hsize < 2 * c->max; c->hsize *= 2)
+            ;
+        c->lba = calloc(c->max, sizeof(lba_t));
+        c->buf = valloc((int64_t)c->max * SECTOR_SIZE);
+        c->hash = calloc(c->hsize, sizeof(int));
+    }
+}
+
+void host_flush(struct volume *v)
+{
+    int g;
+    for (g = 0; g < v->n_groups; g++) {
+        pthread_mutex_lock(&v->groups[g].lock);
+        batch_flush(v, g);
+        seq_flush(v, g);
+        wcache_drain(v, g);
+        pthread_mutex_unlock(&v->groups[g].lock);
+    }
+
+    /* data packets carry their own map records, but a TRIM is only
+     * logged by a checkpoint
+     */
+    pthread_mutex_lock(&v->map_lock);
+    int ckpt = (v->ck_trims > 0);
+    pthread_mutex_unlock(&v->map_lock);
+    if (ckpt)
+        checkpoint_volume(v);
+}
+
+/* turn group commit on (kbytes > 0) or off. Batches are limited to
+ * 'kbytes' of data and 'usecs' of delay.
+ */
+void volume_batching(struct volume *v, int kbytes, int usecs)
+{
+    int g;
+    host_flush(v);
+    for (g = 0; g < v->n_groups; g++) {
+        struct batch *b = &v->groups[g].batch;
+        free(b->buf);
+        free(b->map);
+        b->buf = b->map = NULL;
+    }
+    v->batch_sectors = kbytes * 1024 / SECTOR_SIZE;
+    v->batch_usecs = usecs;
+    if (v->batch_sectors == 0)
+        return;
+    for (g = 0; g < v->n_groups; g++) {
+        struct batch *b = &v->groups[g].batch;
+        b->buf = valloc(v->batch_sectors * SECTOR_SIZE);
+        b->map = calloc(DATA_RECORDS, sizeof(struct map_record));
+    }
+}
+
+/* Threads: each host operation holds the lock of the group it's
+ * working on (split at group boundaries, like the writes themselves)
+ * for its whole duration, including any cleaning it triggers. Data
+ * in a group only moves under that lock, so I/O is done without
+ * holding anything else. v->map_lock is held briefly around anything
+ * shared between groups - the map, seq and base, the band table, and
+ * checkpoints. Lock order is group -> map_lock, and no thread holds
+ * two group locks at once (batch_expire uses trylock).
+ */
+
 void host_write(struct volume *v, lba_t lba, const void *buf, int bytes)
 {
     assert(bytes % SECTOR_SIZE == 0);
@@ -721,17 +2230,52 @@ void host_write(struct volume *v, lba_t lba, const void *buf, int bytes)
     while (sectors > 0) {
         int group = lba / v->group_span;
         int _sectors = min(sectors, (group+1) * v->group_span - lba);
-        do_write(v, group, lba, buf, _sectors, PRIO_NORM);
+        struct group *gr = &v->groups[group];
+        pthread_mutex_lock(&gr->lock);
+        wait_for_space(v, group);
+
+        /* whichever way it goes, older queued copies of these LBAs
+         * have to be written first (or dropped, if they're cached)
+         */
+        if (seq_detect(v, group, lba, _sectors)) {
+            if (batch_overlaps(&gr->batch, lba, _sectors))
+                batch_flush(v, group);
+            wcache_discard(v, group, lba, _sectors);
+            seq_write(v, group, lba, buf, _sectors);
+        }
+        else {
+            if (batch_overlaps(&gr->seq, lba, _sectors))
+                seq_flush(v, group);
+            if (v->wcache_sectors > 0 && _sectors <= WCACHE_MAX_WRITE &&
+                _sectors <= v->wcache_sectors) {
+                if (batch_overlaps(&gr->batch, lba, _sectors))
+                    batch_flush(v, group);
+                wcache_write(v, group, lba, buf, _sectors);
+            }
+            else {
+                wcache_discard(v, group, lba, _sectors);
+                if (v->batch_sectors > 0)
+                    batch_write(v, group, lba, buf, _sectors);
+                else
+                    do_write(v, group, lba, buf, _sectors, PRIO_NORM);
+            }
+        }
+        pthread_mutex_unlock(&gr->lock);
         lba += _sectors;
         sectors -= _sectors;
         buf += (_sectors*SECTOR_SIZE);
     }
+    batch_expire(v);
 
-    if (v->seq - v->oldest_seq > 2000) /* checkpoint every 1000 writes */
+    pthread_mutex_lock(&v->map_lock);
+    int ckpt = (v->seq - v->ck_last > v->ck_interval);
+    pthread_mutex_unlock(&v->map_lock);
+    if (ckpt) {
+        wcache_drain_all(v);
         checkpoint_volume(v);
+    }
 }
 
-#warning FIXME: test TRIM support
 
 void host_trim(struct volume *v, lba_t lba, int sectors)
 {
@@ -744,9 +2288,17 @@ void host_trim(struct volume *v, lba_t lba, int sectors)
         int group = lba / v->group_span;
         int _sectors = min(sectors, (group+1) * v->group_span - lba);
 
+        pthread_mutex_lock(&v->groups[group].lock);
+        batch_flush_range(v, lba, _sectors);
+        wcache_discard(v, group, lba, _sectors);
+
         /* map entries haven't been logged yet, so location=PBA_NULL
          */
+        pthread_mutex_lock(&v->map_lock);
         update_range(v, PBA_NULL, lba, _sectors, null_pba, v->seq++);
+        v->ck_trims++;
+        pthread_mutex_unlock(&v->map_lock);
+        pthread_mutex_unlock(&v->groups[group].lock);
         lba += _sectors;
         sectors -= _sectors;
     }
@@ -754,32 +2306,150 @@ void host_trim(struct volume *v, lba_t lba, int sectors)
 
 /*----------- Read logic --------------*/
 
-void host_read(struct volume *v, lba_t lba, void *buf, int bytes)
+/* a physical read for part of a host read. Pieces of short extents
+ * are read separately, as the whole extent, so they can be cached.
+ */
+struct read_run {
+    void *buf;
+    pba_t pba;
+    int   len;
+    pba_t ext;                  /* extent it's part of, if cacheable */
+    int   ext_len;              /*  0 if not */
+    void *fill;                 /* whole extent read for the cache */
+};
+#define READ_RUNS 32
+
+/* extents up to this many sectors go through the read cache
+ */
+#define RC_MAX_EXTENT 64
+
+/* read part of a single group; caller holds the group lock. Extents
+ * that are contiguous both on disk and in 'buf' (e.g. after cleaning
+ * rewrites them in order) are merged into a single read, and the rest
+ * are queued together before waiting. Unmapped and trimmed sectors
+ * are zero-filled in place. Anything in the staging cache is copied
+ * in afterwards, and if it's all there the disk isn't touched. With
+ * the read cache on, short extents are looked up there first, and
+ * read whole and added to it on a miss.
+ */
+static void read_group(struct volume *v, lba_t lba, void *buf, int sectors)
 {
-    assert(bytes % SECTOR_SIZE == 0);
-    int sectors = bytes / SECTOR_SIZE;
-    assert(lba + sectors <= v->n_groups * v->group_span);
+    struct read_run runs[READ_RUNS];
+    int i, n, phys = 0, g = lba / v->group_span;
+    lba_t lba0 = lba;
+    void *buf0 = buf;
+    int sectors0 = sectors;
 
-    for (sectors = bytes / SECTOR_SIZE; sectors > 0; ) {
+    batch_flush_range(v, lba, sectors);
+    int hits = wcache_read(v, g, lba, NULL, sectors);
+    if (hits == sectors)
+        sectors = 0;
+
+    while (sectors > 0) {
+        pthread_mutex_lock(&v->map_lock);
         struct entry *e = stl_map_lba_geq(v->map, lba);
-        if (e == NULL || e->lba >= lba + sectors) {
-            memset(buf, 17, bytes);
-            return;
-        }
-        int offset = max(lba - e->lba, -sectors), len = -offset;
-        if (offset < 0) {
-            memset(buf, 0, len*SECTOR_SIZE);
+        for (n = 0; sectors > 0 && n < READ_RUNS; ) {
+            int len = sectors;
+            if (e != NULL && e->lba < lba + sectors)
+                len = e->lba - lba;
+            if (len > 0) {      /* unmapped */
+                memset(buf, 0, len*SECTOR_SIZE);
+                sectors -= len;
+                lba += len;
+                buf += len * SECTOR_SIZE;
+                continue;
+            }
+            int offset = lba - e->lba;
+            pba_t pba = pba_add(e->pba, offset);
+            len = min(sectors, e->len - offset);
+            struct read_run *r = n > 0 ? &runs[n-1] : NULL;
+            int cacheable = (v->rcache != NULL && e->len <= RC_MAX_EXTENT);
+            if (e->pba.band < 0) /* TRIM not checkpointed yet */
+                memset(buf, 0, len*SECTOR_SIZE);
+            else if (!cacheable && r != NULL && r->ext_len == 0 &&
+                     r->buf + r->len*SECTOR_SIZE == buf &&
+                     pba_eq(pba_add(r->pba, r->len), pba))
+                r->len += len;
+            else
+                runs[n++] = (struct read_run){.buf = buf, .pba = pba,
+                                              .len = len, .ext = e->pba,
+                                              .ext_len = cacheable ? e->len : 0};
             sectors -= len;
             lba += len;
             buf += len * SECTOR_SIZE;
-            offset = 0;
+            e = stl_map_lba_iterate(v->map, e);
+        }
+        pthread_mutex_unlock(&v->map_lock);
+
+        int fills = 0;
+        for (i = 0; i < n; i++) {
+            struct read_run *r = &runs[i];
+            if (r->ext_len == 0) {
+                smr_read_async(v->disk, r->pba.band, r->pba.offset,
+                               r->buf, r->len);
+                phys++;
+            }
+            else if (!rc_read(v->rcache, r->ext, r->pba.offset - r->ext.offset,
+                              r->buf, r->len)) {
+                r->fill = valloc(r->ext_len * SECTOR_SIZE);
+                smr_read_async(v->disk, r->ext.band, r->ext.offset,
+                               r->fill, r->ext_len);
+                phys++;
+                fills++;
+            }
+        }
+        if (fills == 0)
+            continue;
+        smr_wait(v->disk);
+        for (i = 0; i < n; i++) {
+            struct read_run *r = &runs[i];
+            if (r->fill == NULL)
+                continue;
+            memcpy(r->buf, r->fill + (r->pba.offset - r->ext.offset) * SECTOR_SIZE,
+                   r->len * SECTOR_SIZE);
+            rc_insert(v->rcache, r->ext, r->ext_len, r->fill);
+            free(r->fill);
         }
-        len = min(sectors, e->len - offset);
-        if (len > 0)
-            smr_read(v->disk, e->pba.band, e->pba.offset+offset, buf, len);
-        sectors -= len;
-        lba += len;
     }
+    smr_wait(v->disk);
+    if (hits > 0)
+        wcache_read(v, g, lba0, buf0, sectors0);
+
+    pthread_mutex_lock(&v->map_lock);
+    v->reads.host_reads++;
+    v->reads.phys_reads += phys;
+    v->wc.read_hits += hits;
+    pthread_mutex_unlock(&v->map_lock);
+}
+
+/* read cache of 'mbytes' for the whole volume, 0 = off
+ */
+void volume_rcache(struct volume *v, int mbytes)
+{
+    if (v->rcache != NULL)
+        rc_destroy(v->rcache);
+    v->rcache = NULL;
+    if (mbytes > 0)
+        v->rcache = rc_init(mbytes * 1024LL * 1024 / SECTOR_SIZE, v->n_bands);
+}
+
+void host_read(struct volume *v, lba_t lba, void *buf, int bytes)
+{
+    assert(bytes % SECTOR_SIZE == 0);
+    int sectors = bytes / SECTOR_SIZE;
+    assert(lba + sectors <= v->n_groups * v->group_span);
+
+    while (sectors > 0) {
+        int group = lba / v->group_span;
+        int _sectors = min(sectors, (group+1) * v->group_span - lba);
+        pthread_mutex_lock(&v->groups[group].lock);
+        read_group(v, lba, buf, _sectors);
+        pthread_mutex_unlock(&v->groups[group].lock);
+        lba += _sectors;
+        sectors -= _sectors;
+        buf += (_sectors*SECTOR_SIZE);
+    }
+    batch_expire(v);
 }
 
 /*----------- Map checkpointing --------------*/
@@ -788,56 +2458,202 @@ void host_read(struct volume *v, lba_t lba, void *buf, int bytes)
  * the write pointers.
  */
 
- void write_meta(struct volume *v, int type, int n_records, pba_t next)
+/* write a metadata header. 'data_crc' is the checksum of the
+ * records in the sectors that follow, if any.
+ */
+static void write_meta(struct volume *v, int type, int n_records, pba_t next,
+                       uint32_t data_crc)
 {
     assert(v->band[v->map_band].write_pointer == smr_write_pointer(v->disk, v->map_band));
-    struct header *h = v->buf;
-    memset(v->buf, 0, SECTOR_SIZE);
+    struct header *h = smr_hdr_alloc(v->disk);
+    memset(h, 0, SECTOR_SIZE);
     pba_t location = mkpba(v->map_band, v->band[v->map_band].write_pointer++);
     if (pba_eq(next, PBA_NEXT))
         next = mkpba(v->map_band, v->band[v->map_band].write_pointer);
     *h = (struct header){.magic = STL_MAGIC, .seq = v->seq++,
                          .type = type, .local_records = 0,
                          .records = n_records, .prev = v->map_prev,
-                         .next = next, .base = v->base};
+                         .next = next, .base = v->base,
+                         .data_crc = data_crc};
+    hdr_seal(v->nonce, h);
     // location.offset += 1;
-    smr_write(v->disk, location.band, location.offset, h, 1);
+    smr_write_async(v->disk, location.band, location.offset, h, 1);
+    v->wamp.disk_sectors[v->policy]++;
     v->map_prev = location;
 }
 
 const int map_per_sector = SECTOR_SIZE / sizeof(struct map_record);
 const int band_per_sector = SECTOR_SIZE / sizeof(struct band_record);
 
-#warning FIXME: allow sector-at-a-time processing
-#warning FIXME: see checkpoint size calculations - notes 5/9/15
-/* write map updates and then band updates into map band.
+/* Checkpoints are streamed through v->ck_buf a chunk at a time: each
+ * chunk of up to CK_CHUNK sectors of records goes out under its own
+ * header, and the map band rolls over between chunks if the next one
+ * might not fit, so there's no limit on the size of a checkpoint.
+ * Records are collected in v->ck_recs until the chunk is full, then
+ * sorted and encoded (RECORD_BAND_RLE, RECORD_MAP_DELTA - see stl.h).
  */
-void checkpoint_volume(struct volume *v)
+struct ck_stream {
+    int   type;                 /* RECORD_BAND_RLE or RECORD_MAP_DELTA */
+    int   size;                 /* bytes per record in v->ck_recs */
+    int   n;                    /* records in v->ck_recs */
+    int   bytes;                /*  max size once encoded */
+    int   chunks;               /* written so far */
+    pba_t location;             /* of the current chunk's header */
+};
+
+/* worst-case encoded size of a record: an LBA delta is never bigger
+ * than the LBA, and a band record may start a run of its own.
+ */
+static int ck_bound(struct volume *v, struct ck_stream *s, void *rec)
 {
-    /* calculate previous entry
-     */
-    pba_t next;
+    if (s->type == RECORD_MAP_DELTA) {
+        struct map_record *m = rec;
+        return varint_len(m->lba) + varint_len(m->pba.band + 1) +
+            varint_len(m->pba.offset + 1) + varint_len(m->len);
+    }
+    struct band_record *b = rec;
+    return varint_len(b->band) + varint_len(v->n_bands) +
+        varint_len(b->type) + varint_len(b->write_pointer);
+}
 
-    /* make sure there's enough room in the current map band. Note that we 
-     * don't bother to checkpoint the write pointers for map bands
-     */
+static int map_rec_cmp(const void *a, const void *b)
+{
+    const struct map_record *m1 = a, *m2 = b;
+    return (m1->lba > m2->lba) - (m1->lba < m2->lba);
+}
+
+static int band_rec_cmp(const void *a, const void *b)
+{
+    const struct band_record *b1 = a, *b2 = b;
+    return (b1->band > b2->band) - (b1->band < b2->band);
+}
+
+/* sort the staged records and pack them into v->ck_buf. Returns the
+ * number of records in the stream (runs, for bands) and sets 'bytes'
+ */
+static int ck_encode(struct volume *v, struct ck_stream *s, int *bytes)
+{
+    uint8_t *p = v->ck_buf;
+    int i, j, n = 0;
+
+    if (s->type == RECORD_MAP_DELTA) {
+        struct map_record *m = v->ck_recs;
+        lba_t prev = 0;
+        qsort(m, s->n, sizeof(*m), map_rec_cmp);
+        for (i = 0; i < s->n; i++, n++) {
+            p += varint_put(p, m[i].lba - prev);
+            p += varint_put(p, m[i].pba.band + 1);
+            p += varint_put(p, m[i].pba.offset + 1);
+            p += varint_put(p, m[i].len);
+            prev = m[i].lba;
+        }
+    }
+    else {
+        struct band_record *b = v->ck_recs;
+        int end = 0;
+        qsort(b, s->n, sizeof(*b), band_rec_cmp);
+        for (i = 0; i < s->n; i = j, n++) {
+            for (j = i+1; j < s->n && b[j].band == b[j-1].band + 1 &&
+                     b[j].type == b[i].type &&
+                     b[j].write_pointer == b[i].write_pointer; j++)
+                ;
+            assert(b[i].band >= end);
+            p += varint_put(p, b[i].band - end);
+            p += varint_put(p, j - i);
+            p += varint_put(p, b[i].type);
+            p += varint_put(p, b[i].write_pointer);
+            end = b[j-1].band + 1;
+        }
+    }
+    *bytes = p - (uint8_t*)v->ck_buf;
+    assert(*bytes <= s->bytes);
+    return n;
+}
+
+static int next_map_band(struct volume *v, int i)
+{
+    return (i >= v->map_size) ? 1 : i+1;
+}
+
+/* move on to the next map band unless there's room for a chunk, the
+ * trailer, and the record pointing to the next band
+ */
+static void ck_reserve(struct volume *v)
+{
     int i = v->map_band;
-    int next_band = (i >= v->map_size) ? 1 : i+1;
-    int needed = 2 + 20 + 2 + v->n_bands/band_per_sector + 1;
-    if (v->band[i].write_pointer + needed >= v->band_size) {
-        write_meta(v, RECORD_NULL,
-                   0,                        /* n_records */
-                   mkpba(next_band, 0));       /* next */
-        v->map_band = next_band;
-        v->band[i].write_pointer = 0;
+    int next_band = next_map_band(v, i);
+    if (v->band[i].write_pointer + CK_CHUNK + 3 < v->band_size)
+        return;
+    write_meta(v, RECORD_NULL,
+               0,                        /* n_records */
+               mkpba(next_band, 0),      /* next */
+               0);
+    smr_reset_pointer(v->disk, next_band);
+    v->band[next_band].write_pointer = 0;
+    v->map_band = next_band;
+    v->map_seq[next_band] = v->seq;
+}
+
+static void ck_flush(struct volume *v, struct ck_stream *s)
+{
+    if (s->n == 0)
+        return;
+    int bytes, n = ck_encode(v, s, &bytes);
+    int n_sectors = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int band = v->map_band, wp = v->band[band].write_pointer;
+
+    write_meta(v, s->type, n, mkpba(band, wp+1+n_sectors),
+               crc32c(v->nonce, v->ck_buf, n_sectors * SECTOR_SIZE));
+    smr_write_async(v->disk, band, wp+1, v->ck_buf, n_sectors);
+    v->wamp.disk_sectors[v->policy] += n_sectors;
+    v->band[band].write_pointer += n_sectors;
+    v->ck.records += s->n;
+    v->ck.bytes += bytes;
+    v->ck.sectors += 1 + n_sectors;
+    smr_wait(v->disk);          /* before ck_buf is reused */
+    memset(v->ck_buf, 0, n_sectors * SECTOR_SIZE);
+    s->n = s->bytes = 0;
+    s->chunks++;
+}
+
+/* add a record, returning the location of the header it goes under
+ */
+static pba_t ck_add(struct volume *v, struct ck_stream *s, void *rec)
+{
+    int len = ck_bound(v, s, rec);
+    if (s->bytes + len > CK_CHUNK * SECTOR_SIZE)
+        ck_flush(v, s);
+    if (s->n == 0) {
+        ck_reserve(v);
+        s->location = mkpba(v->map_band, v->band[v->map_band].write_pointer);
     }
+    memcpy(v->ck_recs + s->n++ * s->size, rec, s->size);
+    s->bytes += len;
+    return s->location;
+}
 
-    int min_seq = v->seq;
-    
-    /* checkpoint map entries. always checkpoint the dirty ones.
-     */
-    int n_records, n_map = stl_map_count(v->map);
-    pba_t location = mkpba(v->map_band, v->band[i].write_pointer);
+/* an empty record after the last chunk. Mount replays everything
+ * before the last header in the map band and takes the base from it,
+ * so this goes out after the base is updated.
+ */
+static void ck_trailer(struct volume *v)
+{
+    write_meta(v, RECORD_MAP_DELTA, 0 /* n_records */, PBA_NEXT, 0);
+    v->ck.sectors++;
+}
+
+/* write map updates and then band updates into map band. Takes
+ * map_lock.
+ */
+void checkpoint_volume(struct volume *v)
+{
+    struct ck_stream s;
+    struct band *b = v->band;
+    int i;
+
+    pthread_mutex_lock(&v->map_lock);
+
+    int n_map = stl_map_count(v->map);
     uint32_t cutoff = v->oldest_seq;
 
     /* also roll map updates forward. Assuming each sequence
@@ -850,90 +2666,103 @@ void checkpoint_volume(struct volume *v)
     if (v->seq - v->oldest_seq > 2*n_map) 
         cutoff = v->oldest_seq + 10 * map_per_sector;
 
-    /* write out all the band records that are dirty or older than the
-     * cutoff.
+    /* the map band after this one gets reset when we move on to it,
+     * so anything checkpointed there - i.e. older than the start of
+     * the band after that - has to be rolled forward first.
      */
-    struct band_record *bands = valloc(10 * SECTOR_SIZE);
-    struct band *b = v->band;
-    memset(bands, 0, 10*SECTOR_SIZE);
-
-    for (i = 1+v->map_size, n_records = 0; i < v->n_bands; i++)
-        if (b[i].dirty || b[i].seq < cutoff) {
-            bands[n_records++] = (struct band_record)
-                {.band = i, .type = b[i].type, .write_pointer = b[i].write_pointer};
-            b[i].dirty = 0;
-            b[i].seq = v->seq;
-        }
-        else if (b[i].seq < min_seq)
-            min_seq = b[i].seq;
-
-    assert(n_records < 10 * band_per_sector);
-    if (n_records > 0) {
-        int n_sectors = (n_records + band_per_sector - 1) / band_per_sector;
-        next = mkpba(v->map_band, v->band[v->map_band].write_pointer+1+n_sectors);
+    if (v->map_size >= 3) {
+        uint32_t s2 = v->map_seq[next_map_band(v, next_map_band(v, v->map_band))];
+        if (s2 > cutoff)
+            cutoff = s2;
+    }
 
-        write_meta(v, RECORD_BAND, n_records, next);
-        smr_write(v->disk, v->map_band, v->band[v->map_band].write_pointer, bands, n_sectors);
-        v->band[v->map_band].write_pointer += n_sectors;
-        write_meta(v, RECORD_BAND, 0 /*n_records*/, PBA_NEXT);
+    /* write out all the band records that are dirty or older than the
+     * cutoff - the old ones are at the head of the clean list, and
+     * join the dirty ones.
+     */
+    while (v->band_head >= 0 && b[v->band_head].ck_seq < cutoff) {
+        i = v->band_head;
+        band_clean_remove(v, i);
+        b[i].dirty = 1;
+        v->dirty_bands[v->n_dirty_bands++] = i;
+    }
+    v->ck.checkpoints++;
+    s = (struct ck_stream){.type = RECORD_BAND_RLE,
+                           .size = sizeof(struct band_record)};
+    while (v->n_dirty_bands > 0) {
+        i = v->dirty_bands[--v->n_dirty_bands];
+        struct band_record r = {.band = i, .type = b[i].type,
+                                .write_pointer = b[i].write_pointer};
+        b[i].ck_location = ck_add(v, &s, &r);
+        b[i].ck_wp = r.write_pointer;
+        b[i].dirty = 0;
+        b[i].seq = b[i].ck_seq = v->seq;
+        band_clean_append(v, i);
     }
-    free(bands);
+    ck_flush(v, &s);
+    int chunks = s.chunks;
 
-    /* gather the oldest entries into a checkpoint, and keep track
-     * of the next-oldest entry
+    /* checkpoint map entries - the dirty ones, and the oldest ones
+     * from the head of the clean list. Then the next-oldest is at
+     * the head.
      */
-    struct map_record *map = valloc(20 * SECTOR_SIZE);
-    memset(map, 0, 20*SECTOR_SIZE);
-
-    struct entry *e, *min_e = NULL;
-    n_records = 0;
-    e = stl_map_lba_iterate(v->map, NULL);
-    while (e != NULL) {
-        struct entry *tmp = stl_map_lba_iterate(v->map, e);
-        if (e->seq < cutoff || e->dirty) {
-            map[n_records++] = (struct map_record)
-                {.lba = e->lba, .pba = e->pba, .len = e->len};
-            if (pba_eq(e->pba, PBA_INVALID)) /* TRIM gets logged once */
-                stl_map_remove(v->map, e);   /* and then removed */
-            else {
-                e->seq = v->seq;
-                assert(location.band != 0);
-                e->location = location;
-                e->dirty = 0;
-            }
-        } else if (e->seq < min_seq) {
-            min_seq = e->seq;
-            min_e = e;
+    struct entry *e;
+    struct elist done = {.head = NULL};
+    s = (struct ck_stream){.type = RECORD_MAP_DELTA,
+                           .size = sizeof(struct map_record)};
+    while ((e = v->dirty.head) != NULL ||
+           ((e = v->clean.head) != NULL && e->seq < cutoff)) {
+        struct map_record r = {.lba = e->lba, .pba = e->pba, .len = e->len};
+        if (s.n == 0 && s.chunks == 0)
+            printf("checkpoint at %d\n", v->seq);
+        printf(" %d,+%d -> %d.%d\n", (int)r.lba, r.len, r.pba.band,
+               r.pba.offset);
+        pba_t location = ck_add(v, &s, &r);
+        if (pba_eq(e->pba, PBA_INVALID)) /* TRIM gets logged once */
+            entry_remove(v, e);          /* and then removed */
+        else {
+            elist_remove(e->dirty ? &v->dirty : &v->clean, e);
+            e->seq = v->seq;
+            assert(location.band != 0);
+            e->location = location;
+            e->dirty = 0;
+            elist_append(&done, e);
         }
-        e = tmp;
     }
+    ck_flush(v, &s);
+    chunks += s.chunks;
+    elist_concat(&v->clean, &done);
 
-    /* next-oldest becomes the new base. (unless there are older
-     * bands, in which case we don't update the base)
+    /* the oldest record still needed - band or map entry, from the
+     * head of one of the clean lists - becomes the new base.
      */
-#warning FIXME: what does 'older bands' mean?
-    assert(n_records < 20 * map_per_sector);
-    if (min_e != NULL) {
-        v->oldest_seq = min_seq;
-        v->base = min_e->location;
+    uint32_t oldest = v->seq;
+    if (v->band_head >= 0) {
+        oldest = b[v->band_head].ck_seq;
+        v->base = b[v->band_head].ck_location;
+    }
+    if ((e = v->clean.head) != NULL && e->seq < oldest) {
+        oldest = e->seq;
+        v->base = e->location;
     }
+    v->oldest_seq = oldest;
+    if (chunks > 0)
+        ck_trailer(v);
+    v->ck_last = v->seq;
+    v->ck_trims = 0;
+    smr_wait(v->disk);
+    pthread_mutex_unlock(&v->map_lock);
+}
 
-    /* don't write anything if nothing changed.
-     */
-    if (n_records > 0) {
-        printf("checkpoint at %d\n", v->seq);
-        for (i = 0; i < n_records; i++)
-            printf(" %d,+%d -> %d.%d\n", (int)map[i].lba, map[i].len,
-                   map[i].pba.band, map[i].pba.offset);
-        int n_sectors = (n_records + map_per_sector - 1) / map_per_sector;
-        next =  mkpba(v->map_band, v->band[v->map_band].write_pointer+n_sectors+1);
-
-        write_meta(v, RECORD_MAP, n_records, next);
-        smr_write(v->disk, v->map_band, v->band[v->map_band].write_pointer, map, n_sectors);
-        v->band[v->map_band].write_pointer += n_sectors;
-        write_meta(v, RECORD_MAP, 0 /* n_records */, PBA_NEXT);
-    }
-    free(map);
+/* Since writes since the last checkpoint are rolled forward from the
+ * frontiers on mount, checkpoints can be as far apart as the mount
+ * time allows.
+ */
+void volume_checkpoint_interval(struct volume *v, int seqs)
+{
+    pthread_mutex_lock(&v->map_lock);
+    v->ck_interval = seqs;
+    pthread_mutex_unlock(&v->map_lock);
 }
 
 /*------------ the rest --------------*/
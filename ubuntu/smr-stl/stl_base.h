@@ -6,15 +6,69 @@
 #ifndef __STL_BASE_H__
 #define __STL_BASE_H__
 
+#include <pthread.h>
+
 /*----------- Data Structures ------------*/
 
+/* host writes queued for group commit. Data is packed in 'buf' in
+ * the same order as the records, and all of it goes out as a single
+ * packet (or as few as fit) with the records in the trailer.
+ */
+struct batch {
+    void    *buf;
+    int      sectors;
+    int      n_records;
+    struct map_record *map;     /* only lba, len are valid */
+    lba_t    lo, hi;            /* LBA range touched by queued writes */
+    int64_t  start;             /* usecs - when first write was queued */
+};
+
+/* write-back staging cache - recently written sectors held in RAM so
+ * overwrites are absorbed before they reach the disk. 'hash' is an
+ * open-addressed table of LBA -> slot+1 (0 = empty); slots are only
+ * added until the cache is drained, and a discarded slot keeps its
+ * place with lba = -1.
+ */
+struct wcache {
+    int      n, max;            /* slots used, capacity (sectors) */
+    lba_t   *lba;               /* LBA held in each slot */
+    void    *buf;               /* max sectors of data */
+    int     *hash;
+    int      hsize;             /* power of 2, >= 2*max */
+    lba_t    lo, hi;            /* LBA range touched since last drain */
+};
+
+/* full bands are kept on per-group lists by utilization, in
+ * N_BUCKETS steps of band_size/N_BUCKETS live sectors.
+ */
+#define N_BUCKETS 32
+
+/* each group has a write frontier per stream, so that data moved by
+ * the cleaner doesn't get mixed in with (hotter) host writes. Data
+ * cleaned out of a cleaner band has survived twice and goes to a
+ * third one, and sequential host writes get a band of their own.
+ * Frontier bands are typed BAND_TYPE_FRONTIER + stream.
+ */
+enum {STREAM_HOST, STREAM_CLEAN, STREAM_OLD, STREAM_SEQ, N_FRONTIERS};
+#define FRONTIER_TYPE(s) (BAND_TYPE_FRONTIER + (s))
+#define IS_FRONTIER(t) ((t) >= BAND_TYPE_FRONTIER && \
+                        (t) < BAND_TYPE_FRONTIER + N_FRONTIERS)
+
 /* a band group is a self-sufficient STL with an LBA span and a set of
- * bands.
+ * bands. 'lock' is held across any host operation on the group.
  */
 struct group {
     int count[BAND_TYPE_MAX];
-    int frontier;
-    int frontier_offset;
+    int bucket[N_BUCKETS];      /* list heads, -1 = empty */
+    int frontier[N_FRONTIERS];  /* -1 until first used */
+    int frontier_offset[N_FRONTIERS];
+    struct batch batch;
+    struct batch seq;           /* sequential data staged for STREAM_SEQ */
+    struct wcache wcache;
+    lba_t seq_next;             /* LBA that would continue the stream */
+    int   seq_run;              /*  and sectors written in it so far */
+    void *pkt_buf;              /* data packet header + trailer */
+    pthread_mutex_t lock;
 };
 
 /* track write pointer and band type per band. 
@@ -24,6 +78,83 @@ struct band {
     uint16_t dirty;
     uint32_t write_pointer;     /* next free sector */
     uint32_t seq;               /* of last write it's persisted in */
+    uint32_t data_seq;          /* of last data written to it */
+    uint16_t stream;            /* frontier it was filled as */
+    int32_t  live_sectors;      /* mapped data in this band */
+    int32_t  live_extents;      /*  in this many map entries */
+    int32_t  bucket;            /* utilization list, -1 if not on one */
+    int32_t  b_prev, b_next;
+    uint32_t ck_seq;            /* when its record was last checkpointed */
+    pba_t    ck_location;       /*  and where */
+    int32_t  ck_wp;             /*  with this write pointer */
+    int32_t  ck_prev, ck_next;  /* clean list, see struct elist */
+};
+
+/* Checkpoint bookkeeping, so a checkpoint only looks at what it has
+ * to write. A map entry is either dirty, or clean - in which case
+ * it's on a list in the order it was last checkpointed, which is
+ * also seq order, so the entries older than the roll-forward cutoff
+ * are at the head. Bands are the same, with a stack of dirty band
+ * numbers and a clean list linked through ck_prev/ck_next.
+ */
+struct elist {
+    struct entry *head, *tail;
+    int n;
+};
+
+/* time host writes spent waiting for free bands - either blocked
+ * on the cleaner thread, or cleaning in the foreground. (usecs)
+ */
+struct clean_stats {
+    int64_t n_waits, wait_usecs, max_wait_usecs;
+    int64_t n_fg_cleans, fg_usecs, max_fg_usecs;
+    int64_t n_bg_cleans;        /* bands cleaned by the cleaner thread */
+    int64_t n_stalls;           /*  groups it couldn't gain space in */
+};
+
+/* sectors written while each victim selection policy was in effect,
+ * for write amplification. (data includes cleaning, written includes
+ * headers and checkpoints)
+ */
+#define N_POLICIES 3
+struct wamp_stats {
+    int64_t data_sectors[N_POLICIES];
+    int64_t moved_sectors[N_POLICIES];
+    int64_t disk_sectors[N_POLICIES];
+};
+
+/* host reads, and the physical reads it took to satisfy them
+ */
+struct read_stats {
+    int64_t host_reads;
+    int64_t phys_reads;
+};
+
+/* staging cache activity, in sectors (extents = map records written)
+ */
+struct wcache_stats {
+    int64_t writes, absorbed, read_hits;
+    int64_t drained, extents;
+};
+
+/* checkpoint records written, and their size once encoded; sectors
+ * includes the headers
+ */
+struct ck_stats {
+    int64_t checkpoints, records, bytes, sectors;
+};
+
+/* time spent in each phase of init_volume, and what it read
+ */
+struct mount_stats {
+    int64_t heads_usecs;        /* first sector of each map band */
+    int64_t tail_usecs;         /* last header in the current one */
+    int64_t records_usecs;      /* checkpoint records from the base */
+    int64_t chase_usecs;        /* frontiers past the checkpoint */
+    int64_t ck_usecs;           /* checkpoint, if anything rolled forward */
+    int64_t total_usecs;
+    int64_t reads, sectors;
+    int     rolled;             /* map records rolled forward */
 };
 
 /* the primary data structure. Forward and reverse maps, geometry,
@@ -41,12 +172,49 @@ struct volume {
     int   group_size;
     int   group_span;
     int   n_groups;
+    uint32_t nonce;             /* seeds header checksums */
     struct group *groups;
-    void *buf;                  /* temporary buffer */
+    void *buf;                  /* temporary buffer (init only) */
+    void *ck_buf;               /* CK_CHUNK sectors, for checkpoints */
+    void *ck_recs;              /*  and records waiting to be encoded */
     int   seq;
     pba_t base;                 
     int   oldest_seq;
     pba_t map_prev;
+    int   batch_sectors;        /* group commit: 0 = off */
+    int   batch_usecs;          /*  max time a write sits in a batch */
+    int   policy;               /* cleaning victim selection */
+    int   n_frontiers;          /* cleaning streams in use, 1..3 */
+    int   seq_sectors;          /* sequential stream threshold, 0 = off */
+    struct wamp_stats wamp;     /*  protected by map_lock */
+    struct read_stats reads;    /*  ditto */
+    struct wcache_stats wc;     /*  ditto */
+    struct ck_stats ck;         /*  ditto */
+    struct mount_stats mount;
+    struct elist dirty;         /* map entries, protected by map_lock */
+    struct elist clean;         /*  in checkpoint (seq) order */
+    int  *dirty_bands;          /* stack of dirty data bands */
+    int   n_dirty_bands;
+    int   band_head, band_tail; /* clean data bands in ck_seq order */
+    uint32_t *map_seq;          /* first seq in each map band */
+    int   ck_interval;          /* seq numbers between checkpoints */
+    uint32_t ck_last;           /*  seq of the last one */
+    int   ck_trims;             /* trims only in memory until then */
+    int   wcache_sectors;       /* staging cache size per group, 0 = off */
+    struct rcache *rcache;      /* extent read cache, NULL = off */
+    pthread_mutex_t map_lock;   /* map, seq, base, band table, checkpoint */
+
+    /* background cleaning - see volume_cleaner()
+     */
+    int   cleaner_on;
+    int   cleaner_stop;
+    pthread_t cleaner;
+    pthread_mutex_t clean_lock; /* fields below */
+    pthread_cond_t clean_cv;    /* wakes the cleaner */
+    pthread_cond_t space_cv;    /* cleaner -> blocked writers */
+    uint64_t *need_clean;       /* bitmap of groups below MINFREE_BG */
+    uint64_t *stalled;          /*  of those, ones cleaning can't help */
+    struct clean_stats stats;
 };
 
 /* mapping entry. note that 'lba' and 'pba' are duplicates of the
@@ -60,6 +228,7 @@ struct entry {
     int32_t  len;
     uint32_t seq;
     uint8_t  dirty;
+    struct entry *ck_prev, *ck_next;    /* on v->dirty or v->clean */
 };
 
 /* prototypes */
@@ -0,0 +1,107 @@
+/*
+ * file:        stl_crc.c
+ * description: CRC32C, SSE4.2 or table-driven
+ */
+
+/* every header goes through here, so optimize it even in -O0 builds
+ */
+#pragma GCC optimize("O2")
+
+#include <stdint.h>
+#include <string.h>
+#include "stl.h"
+#include "stl_crc.h"
+
+#define CRC32C_POLY 0x82f63b78  /* reversed Castagnoli */
+
+/* slicing-by-8: crc_table[k][b] is the CRC of byte b followed by k
+ * zero bytes, so 8 bytes are folded in with 8 independent lookups.
+ */
+static uint32_t crc_table[8][256];
+
+static void crc_table_init(void)
+{
+    int i, j, k;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (j = 0; j < 8; j++)
+            c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (k = 1; k < 8; k++)
+            crc_table[k][i] = (crc_table[k-1][i] >> 8) ^
+                crc_table[0][crc_table[k-1][i] & 0xff];
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    if (crc_table[0][1] == 0)
+        crc_table_init();
+    crc = ~crc;
+    for (; len > 0 && ((uintptr_t)p & 7); len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);      /* little-endian */
+        memcpy(&hi, p+4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while (len-- > 0)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    uint64_t c = ~crc;
+    for (; len > 0 && ((uintptr_t)p & 7); len--)
+        c = _mm_crc32_u8(c, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+    for (; len > 0; len--)
+        c = _mm_crc32_u8(c, *p++);
+    return ~(uint32_t)c;
+}
+
+int crc32c_hw(void)
+{
+    static int hw = -1;
+    if (hw < 0)
+        hw = __builtin_cpu_supports("sse4.2");
+    return hw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (crc32c_hw())
+        return crc32c_sse42(crc, buf, len);
+    return crc32c_sw(crc, buf, len);
+}
+
+#else
+
+int crc32c_hw(void)
+{
+    return 0;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+
+#endif
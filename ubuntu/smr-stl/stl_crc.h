@@ -0,0 +1,49 @@
+/*
+ * file:        stl_crc.h
+ * description: CRC32C of headers and metadata
+ */
+#ifndef __STL_CRC_H__
+#define __STL_CRC_H__
+
+#include <stddef.h>
+
+/* CRC32C (Castagnoli), zlib-style: pass 0 to start, or the previous
+ * result to continue. Uses the SSE4.2 crc32 instruction if the CPU has
+ * it, otherwise a table. crc32c_sw is always the table version.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+int crc32c_hw(void);
+
+/* a header's checksum covers the header and its local records, with
+ * the crc field itself taken as 0, and is seeded with the nonce from
+ * the superblock so headers from before a reformat don't match.
+ */
+static inline int hdr_len(struct header *h)
+{
+    int size = (h->type == RECORD_BAND) ? sizeof(struct band_record) :
+        sizeof(struct map_record);
+    return sizeof(*h) + h->local_records * size;
+}
+
+static inline uint32_t hdr_crc(uint32_t nonce, struct header *h)
+{
+    uint32_t save = h->crc, crc;
+    h->crc = 0;
+    crc = crc32c(nonce, h, hdr_len(h));
+    h->crc = save;
+    return crc;
+}
+
+static inline void hdr_seal(uint32_t nonce, struct header *h)
+{
+    h->crc = hdr_crc(nonce, h);
+}
+
+static inline int hdr_valid(uint32_t nonce, struct header *h)
+{
+    return h->magic == STL_MAGIC && hdr_len(h) <= SECTOR_SIZE &&
+        h->crc == hdr_crc(nonce, h);
+}
+
+#endif
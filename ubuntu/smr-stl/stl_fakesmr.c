@@ -1,6 +1,7 @@
 /*
  * file:        stl_fakesmr.c
- * description: fake SMR functions for image files and conventional disks
+ * description: fake SMR functions for image files and conventional disks,
+ *              and Linux zoned block devices through stl_zbd.c
  */
 
 
@@ -14,7 +15,56 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <pthread.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#include "stl_fakesmr.h"
+#include "stl_smrsim.h"
+#include "stl_zbd.h"
+
+/* one outstanding io_uring request. Writes stay here after they
+ * complete until an fdatasync issued after that has finished and the
+ * write pointer reaches them, so that completions out of order never
+ * advance the pointer past unwritten (or not yet durable) data.
+ */
+struct smr_io {
+    int          state;         /* IO_FREE, IO_BUSY, IO_DONE, ... */
+    int          write;
+    unsigned     band;
+    unsigned     offset;
+    unsigned     n_sectors;
+    off_t        pos;           /* byte position of iov[0] */
+    int          hdr;           /* header slot to release, or -1 */
+    int          iovcnt;
+    struct iovec iov[SMR_MAX_IOV];
+};
+
+/* a completed write is IO_DONE, IO_SYNCING once an fdatasync has
+ * been queued behind it, and IO_SYNCED when that finishes
+ */
+enum {IO_FREE, IO_BUSY, IO_DONE, IO_SYNCING, IO_SYNCED};
+
+#define URING_DEPTH 64
+#define HDR_SLOTS   32
+#define SYNC_TAG    URING_DEPTH /* user_data of the fdatasync */
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz;
+    unsigned to_submit;         /* queued, not yet passed to the kernel */
+    unsigned in_flight;         /* submitted or queued, not completed */
+    int syncing;                /* an fdatasync is in flight */
+    struct smr_io io[URING_DEPTH];
+};
 
 struct smr {
     int fd;
@@ -22,7 +72,19 @@ struct smr {
     int band_size;
     off_t wp_position;
     int wp_sectors;
-    int *write_pointers;
+    off_t band_start;           /* sector of band 0 */
+    int band_stride;            /* sectors from one band to the next */
+    int *write_pointers;        /* durable - only advanced on completion */
+    int *submit_pointers;       /* next offset that may be submitted */
+    struct uring *ring;         /* NULL for synchronous I/O */
+    char *hdr_bufs;             /* HDR_SLOTS sectors, registered with ring */
+    int hdr_fixed;              /*  if registering them worked */
+    uint32_t hdr_busy;
+    pthread_mutex_t lock;       /* ring and header buffers */
+    struct smr_sim *sim;        /* timing model, NULL = none */
+    int zoned;                  /* zoned block device, see stl_zbd.h */
+    struct zbd_info zbd;
+    int align;                  /* O_DIRECT buffer alignment, 0 = none */
 };
 
 struct fakeSMR_trailer {
@@ -43,12 +105,24 @@ int smr_band_size(struct smr *dev)
     return dev->band_size;
 }
 
+static off_t band_pos(struct smr *dev, unsigned band, unsigned offset)
+{
+    return (dev->band_start + (off_t)dev->band_stride * band + offset) *
+        SECTOR_SIZE;
+}
+
+/* with queued writes this is the pointer as seen by the next
+ * submission, not the durable one.
+ */
 int smr_write_pointer(struct smr *dev, int band)
 {
     assert(band >= 0 && band < dev->n_bands);
-    return dev->write_pointers[band];
+    return dev->submit_pointers[band];
 }
 
+static struct uring *uring_init(int depth);
+static void uring_free(struct uring *r);
+
 /* initialze a fakeSMR device with a given band size, setting all
  * write pointers to zero. Returns the total number of bands. Used for
  * initial formatting only.
@@ -60,6 +134,20 @@ int smr_init(char *dev, int band_size)
     int fd = open(dev, O_RDWR);
     if (fstat(fd, &sb) < 0)
         assert(0);
+    if (zbd_probe(fd) > 0) {
+        /* the zones are the bands - nothing to write
+         */
+        struct zbd_info z;
+        int *wp, n_bands = -1;
+        if (zbd_open(fd, &z, &wp) == 0) {
+            printf("%s is a zoned device, band size is set by its zones\n",
+                   dev);
+            n_bands = z.n_bands;
+            free(wp);
+        }
+        close(fd);
+        return n_bands;
+    }
     if (S_ISREG(sb.st_mode)) {
         if ((len = lseek(fd, 0, SEEK_END)) < 0)
             assert(0);
@@ -106,8 +194,12 @@ int smr_init(char *dev, int band_size)
 /* open the fake SMR device. Note that we mmap the write pointers at
  * the top of the file / device so that the kernel will (hopefully)
  * keep them up-to-date without a vast amount of overhead.
+ * A zoned block device is used as it is: its sequential zones are the
+ * bands, and the write pointers come from a zone report.
+ * With SMR_URING the *_async functions below use an io_uring instead
+ * of completing synchronously.
  */
-void *smr_open(const char *name)
+struct smr *smr_open_flags(const char *name, int flags)
 {
     off_t len;
     void *buf = NULL, *write_pointers = NULL;
@@ -120,6 +212,27 @@ void *smr_open(const char *name)
     struct stat sb;
     if (fstat(fd, &sb) < 0)
         goto bail;
+    if (zbd_probe(fd) > 0) {
+        if ((dev = calloc(sizeof(*dev), 1)) == NULL ||
+            zbd_open(fd, &dev->zbd, &dev->write_pointers) < 0)
+            goto bail;
+        dev->zoned = 1;
+        dev->n_bands = dev->zbd.n_bands;
+        dev->band_size = dev->zbd.band_size;
+        dev->band_start = (off_t)dev->zbd.first * dev->zbd.zone_len;
+        dev->band_stride = dev->zbd.zone_len;
+
+        /* sequential zones take writes only at the write pointer, so
+         * they can't go through the page cache
+         */
+        if (ioctl(fd, BLKSSZGET, &dev->align) < 0)
+            goto bail;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_DIRECT);
+        printf("%s: %d zones of %.1f MB, %d bands of %.1f MB from zone %d\n",
+               name, dev->zbd.n_zones, dev->zbd.zone_len / 256.0, dev->n_bands,
+               dev->band_size / 256.0, dev->zbd.first);
+        goto opened;
+    }
     if (S_ISREG(sb.st_mode)) {
         if ((len = lseek(fd, 0, SEEK_END)) < 0)
             goto bail;
@@ -146,6 +259,7 @@ void *smr_open(const char *name)
         goto bail;
     dev->n_bands = trail->n_bands;
     dev->band_size = trail->band_size;
+    dev->band_stride = trail->band_size;
 
     int n_sectors = (dev->n_bands + BANDS_PER_SECTOR - 1) / BANDS_PER_SECTOR;
     if (len - n_sectors < dev->n_bands * dev->band_size) {
@@ -172,8 +286,36 @@ void *smr_open(const char *name)
     // flags |= O_DIRECT;
     // fcntl(fd, F_SETFL, flags);
 
+opened:
     dev->fd = fd;
 
+    dev->submit_pointers = malloc(dev->n_bands * sizeof(int));
+    memcpy(dev->submit_pointers, dev->write_pointers, dev->n_bands * sizeof(int));
+    dev->hdr_bufs = valloc(HDR_SLOTS * SECTOR_SIZE);
+    pthread_mutex_init(&dev->lock, NULL);
+
+    /* queued writes to a zone can be reordered on the way to the
+     * drive, which then rejects them
+     */
+    if ((flags & SMR_URING) && dev->zoned)
+        printf("zoned device: using synchronous I/O\n");
+    else if (flags & SMR_URING) {
+        if ((dev->ring = uring_init(URING_DEPTH)) == NULL) {
+            perror("io_uring setup failed, using synchronous I/O");
+        }
+        else {
+            struct iovec iov = {.iov_base = dev->hdr_bufs,
+                                .iov_len = HDR_SLOTS * SECTOR_SIZE};
+            /* without them header writes go out as plain writes
+             */
+            if (syscall(__NR_io_uring_register, dev->ring->fd,
+                        IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+                perror("io_uring buffer registration");
+            else
+                dev->hdr_fixed = 1;
+        }
+    }
+
     free(buf);
 
     return dev;
@@ -188,13 +330,37 @@ bail:
     return NULL;
 }
 
+struct smr *smr_open(const char *name)
+{
+    return smr_open_flags(name, SMR_SYNC);
+}
+
 void smr_close(struct smr *dev)
 {
-    munmap(dev->write_pointers, dev->wp_sectors*SECTOR_SIZE);
+    smr_wait(dev);
+    if (dev->sim)
+        sim_destroy(dev->sim);
+    if (dev->ring)
+        uring_free(dev->ring);
+    free(dev->submit_pointers);
+    free(dev->hdr_bufs);
+    pthread_mutex_destroy(&dev->lock);
+    if (dev->zoned)
+        free(dev->write_pointers);
+    else
+        munmap(dev->write_pointers, dev->wp_sectors*SECTOR_SIZE);
     close(dev->fd);
     free(dev);
 }
 
+/* with O_DIRECT (zoned devices) a buffer that isn't aligned for the
+ * device goes through an aligned copy
+ */
+static int unaligned(struct smr *dev, const void *buf)
+{
+    return dev->align != 0 && ((uintptr_t)buf & (dev->align - 1)) != 0;
+}
+
 /* read from a given band and offset. Note that unsigned values make
  * length checking a bit easier...
  */
@@ -202,11 +368,20 @@ void smr_read(struct smr *dev, unsigned band, unsigned offset, void *buf,
               unsigned n_sectors)
 {
     assert(band < dev->n_bands && offset < dev->band_size &&
-           offset+n_sectors <= dev->write_pointers[band]);
+           offset+n_sectors <= dev->submit_pointers[band]);
+    if (offset+n_sectors > dev->write_pointers[band])
+        smr_wait(dev);          /* reading data still in flight */
     // assert(((long long)buf & 511) == 0);   /* Used for O_DIRECT */
-    off_t position = (dev->band_size * band + offset) * SECTOR_SIZE;
-    int val = pread(dev->fd, buf, n_sectors*SECTOR_SIZE, position);
+    off_t position = band_pos(dev, band, offset);
+    void *tmp = unaligned(dev, buf) ? valloc(n_sectors*SECTOR_SIZE) : NULL;
+    int val = pread(dev->fd, tmp ? tmp : buf, n_sectors*SECTOR_SIZE, position);
     assert(val > 0);
+    if (tmp) {
+        memcpy(buf, tmp, n_sectors*SECTOR_SIZE);
+        free(tmp);
+    }
+    if (dev->sim)
+        sim_read(dev->sim, band, offset, n_sectors);
 }
 
 /* write to a given band and offset. Checks that SMR constraint is
@@ -216,27 +391,486 @@ void smr_write(struct smr *dev, unsigned band, unsigned offset, const void *buf,
                unsigned n_sectors)
 {
     assert(band < dev->n_bands && offset+n_sectors <= dev->band_size);
-    assert(offset == dev->write_pointers[band]);
+    assert(offset == dev->submit_pointers[band]);
+    smr_wait(dev);              /* keep ordering with queued writes */
     // assert(((long long)buf & 511) == 0);	    /* Used for O_DIRECT */
-    off_t position = (dev->band_size * band + offset) * SECTOR_SIZE;
-    //int val = pwrite(dev->fd, buf, n_sectors*SECTOR_SIZE, position);
-    /* changed to use lseek because of pwrite error
-    */
-    lseek(dev->fd, position, SEEK_SET);
-    int val = write(dev->fd, buf, n_sectors*SECTOR_SIZE);
-    assert(val > 0);
+    /* the old "pwrite error" was the offset overflowing an int past
+     * 2GB - compute it as off_t and use a positional write.
+     */
+    off_t position = band_pos(dev, band, offset);
+    void *tmp = NULL;
+    if (unaligned(dev, buf)) {
+        tmp = valloc(n_sectors*SECTOR_SIZE);
+        memcpy(tmp, buf, n_sectors*SECTOR_SIZE);
+    }
+    int val = pwrite(dev->fd, tmp ? tmp : buf, n_sectors*SECTOR_SIZE, position);
+    assert(val == n_sectors*SECTOR_SIZE);
+    free(tmp);
     dev->write_pointers[band] += n_sectors;
+    dev->submit_pointers[band] += n_sectors;
+    if (dev->sim)
+        sim_write(dev->sim, band, offset, n_sectors);
+}
+
+/* gather write - e.g. header, caller's data and trailer for a data
+ * packet in a single system call, without copying the data. Each
+ * iovec must be a whole number of sectors.
+ */
+void smr_writev(struct smr *dev, unsigned band, unsigned offset,
+                const struct iovec *iov, int iovcnt)
+{
+    int i, copy = 0;
+    size_t bytes = 0;
+    for (i = 0; i < iovcnt; i++) {
+        assert(iov[i].iov_len % SECTOR_SIZE == 0);
+        bytes += iov[i].iov_len;
+        copy |= unaligned(dev, iov[i].iov_base);
+    }
+    unsigned n_sectors = bytes / SECTOR_SIZE;
+    assert(band < dev->n_bands && offset+n_sectors <= dev->band_size);
+    assert(offset == dev->submit_pointers[band]);
+    smr_wait(dev);
+    off_t position = band_pos(dev, band, offset);
+    ssize_t val;
+    if (copy) {
+        char *tmp = valloc(bytes), *p = tmp;
+        for (i = 0; i < iovcnt; p += iov[i].iov_len, i++)
+            memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        val = pwrite(dev->fd, tmp, bytes, position);
+        free(tmp);
+    }
+    else
+        val = pwritev(dev->fd, iov, iovcnt, position);
+    assert(val == bytes);
+    dev->write_pointers[band] += n_sectors;
+    dev->submit_pointers[band] += n_sectors;
+    if (dev->sim)
+        sim_write(dev->sim, band, offset, n_sectors);
 }
 
 void smr_reset_pointer(struct smr *dev, unsigned band)
 {
     assert(band < dev->n_bands);
-    dev->write_pointers[band] = 0;
+    smr_wait(dev);
+    if (dev->zoned && zbd_reset(dev->fd, &dev->zbd, band, 1) < 0)
+        assert(0);
+    dev->write_pointers[band] = dev->submit_pointers[band] = 0;
+    if (dev->sim)
+        sim_reset(dev->sim, band);
 }
 
 void smr_reset_all(struct smr *dev)
 {
     int i;
-    for (i = 0; i < dev->n_bands; i++)
-        dev->write_pointers[i] = 0;
+    smr_wait(dev);
+    if (dev->zoned && zbd_reset(dev->fd, &dev->zbd, 0, dev->n_bands) < 0)
+        assert(0);
+    for (i = 0; i < dev->n_bands; i++) {
+        dev->write_pointers[i] = dev->submit_pointers[i] = 0;
+        if (dev->sim)
+            sim_reset(dev->sim, i);
+    }
+}
+
+/* attach a timing model to the device, replacing any there is (see
+ * stl_smrsim.h for the parameters). Every request from then on is
+ * charged modeled time, at submission for queued ones; the data
+ * still goes to the image.
+ */
+int smr_sim(struct smr *dev, const char *params)
+{
+    struct smr_sim *sim = sim_create(dev->n_bands, dev->band_size, params);
+    if (sim == NULL)
+        return -1;
+    smr_wait(dev);
+    if (dev->sim)
+        sim_destroy(dev->sim);
+    dev->sim = sim;
+    return 0;
+}
+
+/* modeled time in ns, or -1 without a model
+ */
+int64_t smr_sim_time(struct smr *dev, struct sim_stats *st)
+{
+    return dev->sim ? sim_time(dev->sim, st) : -1;
+}
+
+void smr_sim_print(struct smr *dev)
+{
+    if (dev->sim)
+        sim_print(dev->sim);
+}
+
+/*---------- Asynchronous I/O (io_uring) -------------*/
+
+/* io_uring without liburing - just the three system calls and the
+ * shared rings.
+ */
+static struct uring *uring_init(int depth)
+{
+    struct io_uring_params p;
+    struct uring *r = calloc(sizeof(*r), 1);
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+        free(r);
+        return NULL;
+    }
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz)
+            r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+        r->sqes == MAP_FAILED) {
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    r->sq_head = r->sq_ring + p.sq_off.head;
+    r->sq_tail = r->sq_ring + p.sq_off.tail;
+    r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ring + p.sq_off.array;
+    r->cq_head = r->cq_ring + p.cq_off.head;
+    r->cq_tail = r->cq_ring + p.cq_off.tail;
+    r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+    r->cqes = r->cq_ring + p.cq_off.cqes;
+    return r;
+}
+
+static void uring_free(struct uring *r)
+{
+    munmap(r->sqes, (*r->sq_mask + 1) * sizeof(struct io_uring_sqe));
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+    free(r);
+}
+
+/* advance durable write pointers over synced writes, in order
+ */
+static void advance_pointers(struct smr *dev)
+{
+    struct uring *r = dev->ring;
+    int i, progress = 1;
+    while (progress)
+        for (i = progress = 0; i < URING_DEPTH; i++) {
+            struct smr_io *io = &r->io[i];
+            if (io->state == IO_SYNCED &&
+                io->offset == dev->write_pointers[io->band]) {
+                dev->write_pointers[io->band] += io->n_sectors;
+                io->state = IO_FREE;
+                progress = 1;
+            }
+        }
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r, int tag);
+static void uring_push(struct smr *dev);
+
+/* a short read or write - queue the rest of it again in the same slot
+ */
+static void io_resubmit(struct smr *dev, struct smr_io *io, size_t done)
+{
+    io->pos += done;
+    while (done >= io->iov[0].iov_len) {
+        done -= io->iov[0].iov_len;
+        io->iovcnt--;
+        memmove(io->iov, io->iov + 1, io->iovcnt * sizeof(io->iov[0]));
+    }
+    io->iov[0].iov_base = (char*)io->iov[0].iov_base + done;
+    io->iov[0].iov_len -= done;
+
+    struct io_uring_sqe *sqe = uring_sqe(dev->ring, io - dev->ring->io);
+    sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = dev->fd;
+    sqe->addr = (unsigned long)io->iov;
+    sqe->len = io->iovcnt;
+    sqe->off = io->pos;
+    uring_push(dev);
+}
+
+static void io_complete(struct smr *dev, struct smr_io *io, int res)
+{
+    size_t i, bytes = 0;
+    for (i = 0; i < io->iovcnt; i++)
+        bytes += io->iov[i].iov_len;
+    assert(res > 0);            /* an error, or a read past the end */
+
+    dev->ring->in_flight--;
+    if (res < bytes) {
+        io_resubmit(dev, io, res);
+        return;
+    }
+    if (io->hdr >= 0)
+        dev->hdr_busy &= ~(1U << io->hdr);
+    io->state = io->write ? IO_DONE : IO_FREE;
+}
+
+/* the data of writes that completed before the fdatasync was queued
+ * is now on disk, so their pointers can move
+ */
+static void sync_complete(struct smr *dev, int res)
+{
+    struct uring *r = dev->ring;
+    int i;
+    assert(res == 0);
+    for (i = 0; i < URING_DEPTH; i++)
+        if (r->io[i].state == IO_SYNCING)
+            r->io[i].state = IO_SYNCED;
+    r->syncing = 0;
+    r->in_flight--;
+    advance_pointers(dev);
+}
+
+/* queue one fdatasync behind all the writes that have completed, so
+ * the write pointers never get to disk ahead of the data
+ */
+static void uring_sync(struct smr *dev)
+{
+    struct uring *r = dev->ring;
+    int i, n = 0;
+    for (i = 0; i < URING_DEPTH; i++)
+        if (r->io[i].state == IO_DONE) {
+            r->io[i].state = IO_SYNCING;
+            n++;
+        }
+    if (n == 0)
+        return;
+
+    struct io_uring_sqe *sqe = uring_sqe(r, SYNC_TAG);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = dev->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    r->syncing = 1;
+    uring_push(dev);
+}
+
+/* pass queued requests to the kernel and wait for at least 'min'
+ * completions, then reap everything that's finished.
+ */
+static void uring_enter(struct smr *dev, unsigned min)
+{
+    struct uring *r = dev->ring;
+    if (r->to_submit > 0 || min > 0) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min,
+                        min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        assert(n >= 0);
+        r->to_submit = 0;
+    }
+
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->user_data == SYNC_TAG)
+            sync_complete(dev, cqe->res);
+        else
+            io_complete(dev, &r->io[cqe->user_data], cqe->res);
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    if (!r->syncing)
+        uring_sync(dev);
+}
+
+/* the next SQE, cleared and tagged
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *r, int tag)
+{
+    unsigned idx = *r->sq_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = tag;
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* grab a free request slot and SQE, waiting for completions if the
+ * ring is full. One SQE is kept back for the fdatasync.
+ */
+static struct io_uring_sqe *uring_get(struct smr *dev, struct smr_io **pio)
+{
+    struct uring *r = dev->ring;
+    int i;
+    for (;;) {
+        for (i = 0; i < URING_DEPTH; i++)
+            if (r->io[i].state == IO_FREE)
+                break;
+        if (i < URING_DEPTH && r->in_flight < *r->sq_mask)
+            break;
+        uring_enter(dev, 1);
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(r, i);
+    *pio = &r->io[i];
+    (*pio)->state = IO_BUSY;
+    (*pio)->hdr = -1;
+    return sqe;
+}
+
+static void uring_push(struct smr *dev)
+{
+    struct uring *r = dev->ring;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    r->in_flight++;
+}
+
+static int hdr_slot(struct smr *dev, const void *buf)
+{
+    const char *p = buf;
+    if (p < dev->hdr_bufs || p >= dev->hdr_bufs + HDR_SLOTS * SECTOR_SIZE)
+        return -1;
+    return (p - dev->hdr_bufs) / SECTOR_SIZE;
+}
+
+/* a sector for a header or other small metadata write, from the
+ * buffers registered with the ring. It's released when the write
+ * using it completes, so every buffer allocated must be written.
+ */
+void *smr_hdr_alloc(struct smr *dev)
+{
+    int i;
+    pthread_mutex_lock(&dev->lock);
+    for (;;) {
+        for (i = 0; i < HDR_SLOTS; i++)
+            if (!(dev->hdr_busy & (1U << i))) {
+                dev->hdr_busy |= (1U << i);
+                pthread_mutex_unlock(&dev->lock);
+                return dev->hdr_bufs + i * SECTOR_SIZE;
+            }
+        assert(dev->ring != NULL);      /* sync writes release at once */
+        uring_enter(dev, 1);
+    }
+}
+
+/* queue a read. The buffer must not be touched until smr_wait.
+ */
+void smr_read_async(struct smr *dev, unsigned band, unsigned offset, void *buf,
+                    unsigned n_sectors)
+{
+    if (dev->ring == NULL) {
+        smr_read(dev, band, offset, buf, n_sectors);
+        return;
+    }
+    assert(band < dev->n_bands && offset < dev->band_size &&
+           offset+n_sectors <= dev->submit_pointers[band]);
+    if (offset+n_sectors > dev->write_pointers[band])
+        smr_wait(dev);
+
+    pthread_mutex_lock(&dev->lock);
+    struct smr_io *io;
+    struct io_uring_sqe *sqe = uring_get(dev, &io);
+    io->write = 0;
+    io->iovcnt = 1;
+    io->iov[0] = (struct iovec){.iov_base = buf,
+                                .iov_len = n_sectors * SECTOR_SIZE};
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = dev->fd;
+    sqe->addr = (unsigned long)io->iov;
+    sqe->len = 1;
+    sqe->off = io->pos = band_pos(dev, band, offset);
+    uring_push(dev);
+    pthread_mutex_unlock(&dev->lock);
+    if (dev->sim)
+        sim_read(dev->sim, band, offset, n_sectors);
+}
+
+/* queue a gather write. The write pointer seen by the next submission
+ * moves immediately; the durable one only when this and all earlier
+ * writes to the band have completed and been synced.
+ */
+void smr_writev_async(struct smr *dev, unsigned band, unsigned offset,
+                      const struct iovec *iov, int iovcnt)
+{
+    int i;
+    if (dev->ring == NULL) {
+        smr_writev(dev, band, offset, iov, iovcnt);
+        pthread_mutex_lock(&dev->lock);
+        for (i = 0; i < iovcnt; i++)
+            if (hdr_slot(dev, iov[i].iov_base) >= 0)
+                dev->hdr_busy &= ~(1U << hdr_slot(dev, iov[i].iov_base));
+        pthread_mutex_unlock(&dev->lock);
+        return;
+    }
+
+    size_t bytes = 0;
+    for (i = 0; i < iovcnt; i++) {
+        assert(iov[i].iov_len % SECTOR_SIZE == 0);
+        bytes += iov[i].iov_len;
+    }
+    unsigned n_sectors = bytes / SECTOR_SIZE;
+    assert(band < dev->n_bands && offset+n_sectors <= dev->band_size);
+    assert(offset == dev->submit_pointers[band]);
+    assert(iovcnt <= SMR_MAX_IOV);
+
+    pthread_mutex_lock(&dev->lock);
+    struct smr_io *io;
+    struct io_uring_sqe *sqe = uring_get(dev, &io);
+    io->write = 1;
+    io->band = band;
+    io->offset = offset;
+    io->n_sectors = n_sectors;
+    io->iovcnt = iovcnt;
+    memcpy(io->iov, iov, iovcnt * sizeof(*iov));
+    sqe->fd = dev->fd;
+    sqe->off = io->pos = band_pos(dev, band, offset);
+
+    /* single header sectors use the pre-registered buffers
+     */
+    io->hdr = (iovcnt == 1) ? hdr_slot(dev, iov[0].iov_base) : -1;
+    if (io->hdr >= 0 && dev->hdr_fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (unsigned long)iov[0].iov_base;
+        sqe->len = iov[0].iov_len;
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)io->iov;
+        sqe->len = iovcnt;
+        for (i = 0; i < iovcnt; i++)
+            assert(io->hdr >= 0 || hdr_slot(dev, iov[i].iov_base) < 0);
+    }
+    dev->submit_pointers[band] += n_sectors;
+    uring_push(dev);
+    pthread_mutex_unlock(&dev->lock);
+    if (dev->sim)
+        sim_write(dev->sim, band, offset, n_sectors);
+}
+
+void smr_write_async(struct smr *dev, unsigned band, unsigned offset,
+                     const void *buf, unsigned n_sectors)
+{
+    struct iovec iov = {.iov_base = (void*)buf,
+                        .iov_len = n_sectors * SECTOR_SIZE};
+    smr_writev_async(dev, band, offset, &iov, 1);
+}
+
+/* submit everything queued and wait until it has all completed -
+ * including requests queued by other threads.
+ */
+void smr_wait(struct smr *dev)
+{
+    if (dev->ring == NULL)
+        return;
+    pthread_mutex_lock(&dev->lock);
+    while (dev->ring->in_flight > 0)
+        uring_enter(dev, 1);
+    pthread_mutex_unlock(&dev->lock);
 }
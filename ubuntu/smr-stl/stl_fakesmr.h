@@ -1,23 +1,55 @@
 /*
  * file:        stl_fakesmr.h
- * description: fake SMR functions for image files and conventional disks
+ * description: fake SMR functions for image files and conventional disks,
+ *              and Linux zoned block devices through stl_zbd.c
  */
 
 #ifndef __STL_FAKESMR_H__
 #define __STL_FAKESMR_H__
 
+#include <stdint.h>
+
 struct smr;
 int smr_n_bands(struct smr *dev);
 int smr_band_size(struct smr *dev);
 int smr_write_pointer(struct smr *dev, int band);
 int smr_init(char *dev, int band_size);
 struct smr *smr_open(const char *name);
+
+/* flags for smr_open_flags
+ */
+#define SMR_SYNC  0
+#define SMR_URING 1             /* queue *_async I/O on an io_uring */
+struct smr *smr_open_flags(const char *name, int flags);
 void smr_close(struct smr *dev);
 void smr_read(struct smr *dev, unsigned band, unsigned offset, void *buf,
               unsigned n_sectors);
 void smr_write(struct smr *dev, unsigned band, unsigned offset, const void *buf,
                unsigned n_sectors);
+struct iovec;
+void smr_writev(struct smr *dev, unsigned band, unsigned offset,
+                const struct iovec *iov, int iovcnt);
 void smr_reset_pointer(struct smr *dev, unsigned band);
 void smr_reset_all(struct smr *dev);
 
+/* queued I/O - completes synchronously unless opened with SMR_URING.
+ * Buffers belong to the device until smr_wait returns.
+ */
+#define SMR_MAX_IOV 4
+void smr_read_async(struct smr *dev, unsigned band, unsigned offset, void *buf,
+                    unsigned n_sectors);
+void smr_write_async(struct smr *dev, unsigned band, unsigned offset,
+                     const void *buf, unsigned n_sectors);
+void smr_writev_async(struct smr *dev, unsigned band, unsigned offset,
+                      const struct iovec *iov, int iovcnt);
+void *smr_hdr_alloc(struct smr *dev);
+void smr_wait(struct smr *dev);
+
+/* optional timing model, see stl_smrsim.h
+ */
+int smr_sim(struct smr *dev, const char *params);
+struct sim_stats;
+int64_t smr_sim_time(struct smr *dev, struct sim_stats *st);
+void smr_sim_print(struct smr *dev);
+
 #endif
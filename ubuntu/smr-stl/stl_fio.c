@@ -0,0 +1,253 @@
+/*
+ * file:        stl_fio.c
+ * description: fio external ioengine calling the STL directly
+ *
+ * Built into libstl.so with 'make libstl.so FIO=<fio source tree>'
+ * (a configured one - config-host.h has to exist). Then e.g.:
+ *
+ *   fio --thread --ioengine=external:./libstl.so --filename=image.img \
+ *       --rw=randwrite --bs=4k --size=1g --numjobs=4 --name=stl
+ *
+ * The filename is a fake SMR image made with mkfakesmr and format.
+ * host_read/host_write don't return until the I/O is done, so this is
+ * a sync engine and queue depth comes from numjobs, not iodepth - the
+ * volume runs requests to different groups in parallel. All jobs
+ * share one volume, which only works if they're threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fio.h"
+#include "optgroup.h"
+
+#include "stl.h"
+#include "stl_public.h"
+
+struct stl_fio_options {
+    void *pad;                  /* fio puts the thread_data here */
+    unsigned int uring;
+    unsigned int cleaner;
+    unsigned int batch_kb;
+    unsigned int wcache_mb;
+    unsigned int rcache_mb;
+    unsigned int frontiers;
+    char *policy;
+};
+
+static struct fio_option options[] = {
+    {
+        .name     = "stl_uring",
+        .lname    = "STL io_uring backend",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct stl_fio_options, uring),
+        .help     = "Use io_uring for the fake SMR image",
+        .def      = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_cleaner",
+        .lname    = "STL background cleaner",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct stl_fio_options, cleaner),
+        .help     = "Run the background cleaning thread",
+        .def      = "1",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_batch",
+        .lname    = "STL group commit KB",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct stl_fio_options, batch_kb),
+        .help     = "Group commit batch size in KB (0 = off)",
+        .def      = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_wcache",
+        .lname    = "STL staging cache MB",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct stl_fio_options, wcache_mb),
+        .help     = "Write staging cache in MB (0 = off)",
+        .def      = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_rcache",
+        .lname    = "STL read cache MB",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct stl_fio_options, rcache_mb),
+        .help     = "Extent read cache in MB (0 = off)",
+        .def      = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_frontiers",
+        .lname    = "STL write streams",
+        .type     = FIO_OPT_INT,
+        .off1     = offsetof(struct stl_fio_options, frontiers),
+        .help     = "Write frontiers per group, 1-3 (0 = default)",
+        .def      = "0",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "stl_policy",
+        .lname    = "STL cleaning policy",
+        .type     = FIO_OPT_STR_STORE,
+        .off1     = offsetof(struct stl_fio_options, policy),
+        .help     = "greedy, cost-benefit or seeks",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = NULL,
+    },
+};
+
+/* one volume for all the jobs, opened by the first open_file and
+ * closed by the last close_file
+ */
+static pthread_mutex_t vol_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct volume *vol;
+static char *vol_name;
+static int vol_refs;
+
+static struct volume *vol_get(struct stl_fio_options *o, const char *name)
+{
+    pthread_mutex_lock(&vol_lock);
+    if (vol != NULL && strcmp(name, vol_name) != 0) {
+        log_err("libstl: one image at a time (%s is open)\n", vol_name);
+        pthread_mutex_unlock(&vol_lock);
+        return NULL;
+    }
+    if (vol == NULL) {
+        if ((vol = init_volume_flags(name, o->uring ? STL_URING : 0)) == NULL) {
+            log_err("libstl: can't open %s\n", name);
+            pthread_mutex_unlock(&vol_lock);
+            return NULL;
+        }
+        vol_name = strdup(name);
+        if (o->policy && volume_policy(vol, o->policy) < 0)
+            log_err("libstl: unknown policy %s, ignored\n", o->policy);
+        if (o->frontiers > 0 && o->frontiers <= 3)
+            volume_frontiers(vol, o->frontiers);
+        if (o->wcache_mb > 0)
+            volume_wcache(vol, o->wcache_mb);
+        if (o->rcache_mb > 0)
+            volume_rcache(vol, o->rcache_mb);
+        if (o->batch_kb > 0)
+            volume_batching(vol, o->batch_kb, 1000);
+        if (o->cleaner)
+            volume_cleaner(vol, 1);
+    }
+    vol_refs++;
+    pthread_mutex_unlock(&vol_lock);
+    return vol;
+}
+
+static void vol_put(void)
+{
+    pthread_mutex_lock(&vol_lock);
+    if (--vol_refs == 0) {
+        host_flush(vol);
+        delete_volume(vol);
+        vol = NULL;
+        free(vol_name);
+        vol_name = NULL;
+    }
+    pthread_mutex_unlock(&vol_lock);
+}
+
+static int fio_stl_init(struct thread_data *td)
+{
+    if (!td->o.use_thread) {
+        log_err("libstl: jobs share the volume, so 'thread' must be set\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* fio wants the size before any job has started
+ */
+static int fio_stl_get_file_size(struct thread_data *td, struct fio_file *f)
+{
+    struct volume *v = vol_get(td->eo, f->file_name);
+    if (v == NULL)
+        return 1;
+    f->real_file_size = volume_size(v);
+    fio_file_set_size_known(f);
+    vol_put();
+    return 0;
+}
+
+static int fio_stl_open_file(struct thread_data *td, struct fio_file *f)
+{
+    struct volume *v = vol_get(td->eo, f->file_name);
+    if (v == NULL)
+        return 1;
+    FILE_SET_ENG_DATA(f, v);
+    return 0;
+}
+
+static int fio_stl_close_file(struct thread_data *td, struct fio_file *f)
+{
+    if (FILE_ENG_DATA(f) != NULL) {
+        FILE_SET_ENG_DATA(f, NULL);
+        vol_put();
+    }
+    return 0;
+}
+
+static enum fio_q_status fio_stl_queue(struct thread_data *td,
+                                       struct io_u *io_u)
+{
+    struct volume *v = FILE_ENG_DATA(io_u->file);
+    lba_t lba = io_u->offset / SECTOR_SIZE;
+
+    fio_ro_check(td, io_u);
+
+    if (!ddir_sync(io_u->ddir) &&
+        (io_u->offset % SECTOR_SIZE || io_u->xfer_buflen % SECTOR_SIZE)) {
+        io_u->error = EINVAL;
+        return FIO_Q_COMPLETED;
+    }
+    switch (io_u->ddir) {
+    case DDIR_READ:
+        host_read(v, lba, io_u->xfer_buf, io_u->xfer_buflen);
+        break;
+    case DDIR_WRITE:
+        host_write(v, lba, io_u->xfer_buf, io_u->xfer_buflen);
+        break;
+    case DDIR_TRIM:
+        host_trim(v, lba, io_u->xfer_buflen / SECTOR_SIZE);
+        break;
+    case DDIR_SYNC:
+    case DDIR_DATASYNC:
+        host_flush(v);
+        break;
+    default:
+        io_u->error = EINVAL;
+    }
+    return FIO_Q_COMPLETED;
+}
+
+struct ioengine_ops ioengine = {
+    .name               = "libstl",
+    .version            = FIO_IOOPS_VERSION,
+    .flags              = FIO_SYNCIO | FIO_DISKLESSIO | FIO_NOEXTEND,
+    .init               = fio_stl_init,
+    .queue              = fio_stl_queue,
+    .open_file          = fio_stl_open_file,
+    .close_file         = fio_stl_close_file,
+    .get_file_size      = fio_stl_get_file_size,
+    .options            = options,
+    .option_struct_size = sizeof(struct stl_fio_options),
+};
@@ -9,6 +9,7 @@
 #include "rbtree.h"
 #include "stl.h"
 #include "stl_map.h"
+#include "stl_slab.h"
 
 /* 'location' is the header of the checkpoint packet that this entry
  * was last written in. Not valid if the entry is dirty.
@@ -25,6 +26,7 @@ struct entry {
 struct map_pair {
     rb_tree_t fmap;
     rb_tree_t rmap;
+    struct slab entries;        /* all entries are allocated from here */
 };
 
 /* returns equal if the LBA intervals overlap
@@ -60,7 +62,8 @@ static rb_tree_ops_t fwd_ops = {
     .rbto_context = 0
 };
 
-/* returns equal if the PBA intervals start at the same address.
+/* orders by starting PBA. TRIM entries all have PBA_INVALID, so the
+ * LBA breaks ties between them.
  */
 static signed int compare_nodes_rev(void *ctx, const void *n1, const void *n2)
 {
@@ -68,7 +71,9 @@ static signed int compare_nodes_rev(void *ctx, const void *n1, const void *n2)
 
     if (e1->pba.band != e2->pba.band)
         return e1->pba.band - e2->pba.band;
-    return e1->pba.offset - e2->pba.offset;
+    if (e1->pba.offset != e2->pba.offset)
+        return e1->pba.offset - e2->pba.offset;
+    return (e1->lba > e2->lba) - (e1->lba < e2->lba);
     
 #if 0
     if (e1->pba.offset + e1->len <= e2->pba.offset)
@@ -113,34 +118,32 @@ static rb_tree_ops_t rev_ops = {
  */
 void *stl_map_init(void)
 {
-    struct map_pair *maps = malloc(sizeof(*maps));
+    struct map_pair *maps = calloc(sizeof(*maps), 1);
     rb_tree_init(&maps->fmap, &fwd_ops);
     rb_tree_init(&maps->rmap, &rev_ops);
     return maps;
 }
 
-/* free a map pair and all the entries in it. note that entries are in
- * both, so we just need to iterate through one.
+/* free a map pair and all the entries in it. The tree nodes are
+ * embedded in the entries, so we can just drop the whole arena.
  */
 void stl_map_destroy(void *_maps)
 {
     struct map_pair *maps = _maps;
-    struct entry *e = rb_tree_iterate(&maps->fmap, NULL, RB_DIR_RIGHT);
-    while (e != NULL) {
-        struct entry *tmp = rb_tree_iterate(&maps->fmap, e, RB_DIR_RIGHT);
-        rb_tree_remove_node(&maps->fmap, e);
-        rb_tree_remove_node(&maps->rmap, e);
-        free(e);
-        e = tmp;
-    }
+    slab_destroy(&maps->entries);
     free(maps);
 }
 
-/* create a map entry with 'len' extra bytes for user data
+/* create a map entry with 'len' extra bytes for user data. 'len' has
+ * to be the same for every entry in a map.
  */    
-void *stl_map_entry(int len)
+void *stl_map_entry(void *_maps, int len)
 {
-    struct entry *e = malloc(sizeof(*e) + len);
+    struct map_pair *maps = _maps;
+    if (maps->entries.obj_size == 0)
+        slab_init(&maps->entries, sizeof(struct entry) + len);
+    assert(maps->entries.obj_size >= sizeof(struct entry) + len);
+    struct entry *e = slab_alloc(&maps->entries);
     return e+1;
 }
 
@@ -168,7 +171,7 @@ void stl_map_remove(void *_maps, void *_e)
     if (e != NULL) e--;
     rb_tree_remove_node(&maps->fmap, e);
     rb_tree_remove_node(&maps->rmap, e);
-    free(e);
+    slab_free(&maps->entries, e);
 }
 
 /* update a map entry. Don't change the order of entries or things
@@ -229,3 +232,12 @@ int  stl_map_count(void *_maps)
     return rb_tree_count(&maps->fmap);
 }
 
+/* entry allocator counters: live and peak entries, chunks in use
+ */
+void stl_map_alloc_stats(void *_maps, int *live, int *peak, int *chunks)
+{
+    struct map_pair *maps = _maps;
+    *live = maps->entries.live;
+    *peak = maps->entries.peak;
+    *chunks = maps->entries.n_chunks;
+}
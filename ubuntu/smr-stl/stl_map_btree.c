@@ -0,0 +1,546 @@
+/*
+ * file:        stl_map_btree.c
+ * description: LBA->PBA and PBA->LBA map implementation using a pair
+ *              of in-memory B+-trees. Drop-in replacement for the
+ *              red/black version in stl_map.c - select with 'make MAP=btree'
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "stl.h"
+#include "stl_map.h"
+#include "stl_slab.h"
+
+/* Nodes are fixed-size and hold BT_ORDER sorted keys, so a lookup
+ * touches O(log_64 n) nodes and in-order iteration is a scan along
+ * the leaf arrays. Keys are copied into the nodes; the entries
+ * themselves live outside the tree so that pointers handed out to
+ * the caller stay valid across inserts and removes.
+ */
+#define BT_ORDER 64
+#define BT_MIN   (BT_ORDER/4)   /* try to merge nodes below this */
+
+#define FWD 0
+#define REV 1
+
+/* key is (lba, 0) for the forward map and (band.offset, lba) for the
+ * reverse map - the LBA breaks ties between TRIM entries, which all
+ * have PBA_INVALID.
+ */
+struct bt_key {
+    int64_t k1;
+    int64_t k2;
+};
+
+struct bt_node {
+    int16_t         leaf;
+    int16_t         n;
+    struct bt_node *parent;
+    struct bt_node *prev, *next;        /* leaf siblings */
+    struct bt_key   key[BT_ORDER];      /* key[0] unused in interior nodes */
+    void           *ptr[BT_ORDER];      /* children, or entries in a leaf */
+};
+
+/* hidden header in front of the caller's data. 'leaf' is the leaf
+ * currently holding the entry in each of the two trees.
+ */
+struct entry {
+    struct bt_node *leaf[2];
+    int64_t         lba;
+    struct pba      pba;
+    int             len;
+};
+
+struct bt_tree {
+    struct bt_node *root;
+    struct bt_node *first;              /* leftmost leaf */
+};
+
+struct map_pair {
+    struct bt_tree tree[2];
+    int            count;
+    struct slab    entries;         /* all entries are allocated from here */
+};
+
+static inline int key_cmp(struct bt_key a, struct bt_key b)
+{
+    if (a.k1 != b.k1)
+        return (a.k1 < b.k1) ? -1 : 1;
+    if (a.k2 != b.k2)
+        return (a.k2 < b.k2) ? -1 : 1;
+    return 0;
+}
+
+static inline int64_t pba_key(struct pba pba)
+{
+    return (int64_t)(((uint64_t)(uint32_t)pba.band << 32) | (uint32_t)pba.offset);
+}
+
+static inline struct bt_key entry_key(struct entry *e, int which)
+{
+    if (which == FWD)
+        return (struct bt_key){.k1 = e->lba, .k2 = 0};
+    return (struct bt_key){.k1 = pba_key(e->pba), .k2 = e->lba};
+}
+
+static struct bt_node *node_alloc(int leaf)
+{
+    struct bt_node *n = calloc(sizeof(*n), 1);
+    n->leaf = leaf;
+    return n;
+}
+
+/* index of the last key <= 'key' in a node, or -1 if all are greater.
+ * For interior nodes key[0] is treated as -infinity, so the result is
+ * always a valid child.
+ */
+static int node_search(struct bt_node *n, struct bt_key key)
+{
+    int lo = n->leaf ? 0 : 1, hi = n->n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (key_cmp(n->key[mid], key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return hi;
+}
+
+/* descend to the leaf whose key range covers 'key'
+ */
+static struct bt_node *bt_find_leaf(struct bt_tree *t, struct bt_key key)
+{
+    struct bt_node *n = t->root;
+    while (n != NULL && !n->leaf)
+        n = n->ptr[node_search(n, key)];
+    return n;
+}
+
+/* find the leaf and slot of the last entry <= key. Slot is -1 if the
+ * key is smaller than everything in the tree. Separators are only
+ * lower bounds, so the predecessor may be at the end of the previous
+ * leaf.
+ */
+static struct bt_node *bt_find_leq(struct bt_tree *t, struct bt_key key,
+                                   int *pidx)
+{
+    struct bt_node *n = bt_find_leaf(t, key);
+    if (n == NULL) {
+        *pidx = -1;
+        return NULL;
+    }
+    *pidx = node_search(n, key);
+    if (*pidx < 0 && n->prev != NULL) {
+        n = n->prev;
+        *pidx = n->n - 1;
+    }
+    return n;
+}
+
+/* step to the next slot in leaf order. Returns NULL at the end.
+ */
+static struct entry *bt_next(struct bt_node **pleaf, int *pidx)
+{
+    struct bt_node *n = *pleaf;
+    int i = *pidx + 1;
+    while (n != NULL && i >= n->n) {
+        n = n->next;
+        i = 0;
+    }
+    *pleaf = n;
+    *pidx = i;
+    return (n == NULL) ? NULL : n->ptr[i];
+}
+
+/* slot holding entry 'e' in its leaf for tree 'which'
+ */
+static int bt_slot(struct entry *e, int which)
+{
+    struct bt_node *n = e->leaf[which];
+    int i = node_search(n, entry_key(e, which));
+    assert(i >= 0 && n->ptr[i] == e);
+    return i;
+}
+
+/* point the moved children/entries of a node back at it
+ */
+static void fix_parents(struct bt_node *n, int which, int from)
+{
+    int i;
+    for (i = from; i < n->n; i++)
+        if (n->leaf)
+            ((struct entry *)n->ptr[i])->leaf[which] = n;
+        else
+            ((struct bt_node *)n->ptr[i])->parent = n;
+}
+
+/* index of child 'c' in its parent
+ */
+static int child_slot(struct bt_node *c)
+{
+    struct bt_node *p = c->parent;
+    int i;
+    for (i = 0; i < p->n; i++)
+        if (p->ptr[i] == c)
+            return i;
+    assert(0);
+    return -1;
+}
+
+/* reset the separator in front of leaf 'n' to its smallest key.
+ * Separators are normally allowed to go stale (they are only lower
+ * bounds), but stl_map_update can move the last key of the previous
+ * leaf past a stale one.
+ */
+static void bt_fix_separator(struct bt_node *n)
+{
+    struct bt_node *c;
+    for (c = n; c->parent != NULL; c = c->parent) {
+        int i = child_slot(c);
+        if (i > 0) {
+            c->parent->key[i] = n->key[0];
+            return;
+        }
+    }
+}
+
+static void node_insert_at(struct bt_node *n, int i, struct bt_key key, void *p)
+{
+    memmove(&n->key[i+1], &n->key[i], (n->n - i) * sizeof(n->key[0]));
+    memmove(&n->ptr[i+1], &n->ptr[i], (n->n - i) * sizeof(n->ptr[0]));
+    n->key[i] = key;
+    n->ptr[i] = p;
+    n->n++;
+}
+
+static void node_remove_at(struct bt_node *n, int i)
+{
+    memmove(&n->key[i], &n->key[i+1], (n->n - i - 1) * sizeof(n->key[0]));
+    memmove(&n->ptr[i], &n->ptr[i+1], (n->n - i - 1) * sizeof(n->ptr[0]));
+    n->n--;
+}
+
+/* split a full node in half, inserting the new right half into the
+ * parent (splitting it too if necessary).
+ */
+static void bt_split(struct bt_tree *t, struct bt_node *n, int which)
+{
+    struct bt_node *r = node_alloc(n->leaf);
+    int half = n->n / 2;
+
+    r->n = n->n - half;
+    memcpy(r->key, &n->key[half], r->n * sizeof(r->key[0]));
+    memcpy(r->ptr, &n->ptr[half], r->n * sizeof(r->ptr[0]));
+    n->n = half;
+    fix_parents(r, which, 0);
+
+    if (n->leaf) {
+        r->next = n->next;
+        r->prev = n;
+        if (n->next)
+            n->next->prev = r;
+        n->next = r;
+    }
+
+    struct bt_node *p = n->parent;
+    if (p == NULL) {
+        p = node_alloc(0);
+        p->key[0] = n->key[0];
+        p->ptr[0] = n;
+        p->n = 1;
+        n->parent = p;
+        t->root = p;
+    }
+    r->parent = p;
+    node_insert_at(p, child_slot(n) + 1, r->key[0], r);
+    if (p->n == BT_ORDER)
+        bt_split(t, p, which);
+}
+
+static void bt_insert(struct bt_tree *t, struct entry *e, int which)
+{
+    struct bt_key key = entry_key(e, which);
+    int i;
+
+    if (t->root == NULL)
+        t->root = t->first = node_alloc(1);
+
+    struct bt_node *n = bt_find_leaf(t, key);
+    i = node_search(n, key);
+    assert(i < 0 || key_cmp(n->key[i], key) != 0);
+    node_insert_at(n, i+1, key, e);
+    e->leaf[which] = n;
+    if (n->n == BT_ORDER)
+        bt_split(t, n, which);
+}
+
+/* remove an (empty, or merged-away) node from the tree, propagating
+ * upwards.
+ */
+static void bt_rebalance(struct bt_tree *t, struct bt_node *n, int which);
+
+static void bt_unlink(struct bt_tree *t, struct bt_node *n, int which)
+{
+    struct bt_node *p = n->parent;
+
+    if (n->leaf) {
+        if (n->prev)
+            n->prev->next = n->next;
+        else
+            t->first = n->next;
+        if (n->next)
+            n->next->prev = n->prev;
+    }
+    if (p == NULL) {
+        t->root = t->first = NULL;
+        free(n);
+        return;
+    }
+    node_remove_at(p, child_slot(n));
+    free(n);
+    bt_rebalance(t, p, which);
+}
+
+/* fold the right sibling of 'n' into it, if they share a parent and
+ * the result fits. Returns true if merged.
+ */
+static int bt_merge_right(struct bt_tree *t, struct bt_node *n, int which)
+{
+    struct bt_node *p = n->parent;
+    int i = child_slot(n);
+    if (i+1 >= p->n)
+        return 0;
+    struct bt_node *r = p->ptr[i+1];
+    if (n->n + r->n > BT_ORDER * 3 / 4)
+        return 0;
+
+    int from = n->n;
+    memcpy(&n->key[from], r->key, r->n * sizeof(r->key[0]));
+    memcpy(&n->ptr[from], r->ptr, r->n * sizeof(r->ptr[0]));
+    if (!n->leaf)
+        n->key[from] = p->key[i+1];     /* separator replaces unused key[0] */
+    n->n += r->n;
+    fix_parents(n, which, from);
+    r->n = 0;
+    bt_unlink(t, r, which);
+    return 1;
+}
+
+/* called after removing something from 'n'. Empty nodes are
+ * unlinked, small ones are merged with a neighbor, and a root with a
+ * single child is collapsed.
+ */
+static void bt_rebalance(struct bt_tree *t, struct bt_node *n, int which)
+{
+    if (n->n == 0) {
+        bt_unlink(t, n, which);
+        return;
+    }
+    if (n->parent == NULL) {
+        if (!n->leaf && n->n == 1) {
+            t->root = n->ptr[0];
+            t->root->parent = NULL;
+            free(n);
+        }
+        return;
+    }
+    if (n->n < BT_MIN && !bt_merge_right(t, n, which)) {
+        int i = child_slot(n);
+        if (i > 0)
+            bt_merge_right(t, n->parent->ptr[i-1], which);
+    }
+}
+
+static void bt_remove(struct bt_tree *t, struct entry *e, int which)
+{
+    struct bt_node *n = e->leaf[which];
+    node_remove_at(n, bt_slot(e, which));
+    e->leaf[which] = NULL;
+    bt_rebalance(t, n, which);
+}
+
+static void bt_free_nodes(struct bt_node *n)
+{
+    int i;
+    if (!n->leaf)
+        for (i = 0; i < n->n; i++)
+            bt_free_nodes(n->ptr[i]);
+    free(n);
+}
+
+/* ---------- PUBLIC FUNCTIONS ----------- */
+
+/* initialize a forward and reverse map pair.
+ */
+void *stl_map_init(void)
+{
+    struct map_pair *maps = calloc(sizeof(*maps), 1);
+    return maps;
+}
+
+/* free a map pair and all the entries in it. Entries go in one shot
+ * with their arena; only the tree nodes have to be walked.
+ */
+void stl_map_destroy(void *_maps)
+{
+    struct map_pair *maps = _maps;
+    slab_destroy(&maps->entries);
+    if (maps->tree[FWD].root)
+        bt_free_nodes(maps->tree[FWD].root);
+    if (maps->tree[REV].root)
+        bt_free_nodes(maps->tree[REV].root);
+    free(maps);
+}
+
+/* create a map entry with 'len' extra bytes for user data. 'len' has
+ * to be the same for every entry in a map.
+ */
+void *stl_map_entry(void *_maps, int len)
+{
+    struct map_pair *maps = _maps;
+    if (maps->entries.obj_size == 0)
+        slab_init(&maps->entries, sizeof(struct entry) + len);
+    assert(maps->entries.obj_size >= sizeof(struct entry) + len);
+    struct entry *e = slab_alloc(&maps->entries);
+    memset(e, 0, sizeof(*e) + len);
+    return e+1;
+}
+
+/* insert map entry at lba..+len and pba..+len in the two maps
+ */
+void stl_map_insert(void *_maps, void *_e, lba_t lba, pba_t pba, int len)
+{
+    struct map_pair *maps = _maps;
+    struct entry *e = _e;
+    if (e != NULL) e--;
+    e->lba = lba;
+    e->pba = pba;
+    e->len = len;
+    bt_insert(&maps->tree[FWD], e, FWD);
+    bt_insert(&maps->tree[REV], e, REV);
+    maps->count++;
+}
+
+/* remove and free a map entry.
+ */
+void stl_map_remove(void *_maps, void *_e)
+{
+    struct map_pair *maps = _maps;
+    struct entry *e = _e;
+    if (e != NULL) e--;
+    bt_remove(&maps->tree[FWD], e, FWD);
+    bt_remove(&maps->tree[REV], e, REV);
+    maps->count--;
+    slab_free(&maps->entries, e);
+}
+
+/* update a map entry. Don't change the order of entries or things
+ * will break. (the new keys are written back into the leaves, which
+ * is why we need to find the slots using the old ones)
+ */
+void stl_map_update(void *_e, lba_t lba, pba_t pba, int len)
+{
+    struct entry *e = _e;
+    if (e != NULL) e--;
+    int fi = bt_slot(e, FWD), ri = bt_slot(e, REV);
+    e->lba = lba;
+    e->pba = pba;
+    e->len = len;
+    e->leaf[FWD]->key[fi] = entry_key(e, FWD);
+    e->leaf[REV]->key[ri] = entry_key(e, REV);
+    if (fi == e->leaf[FWD]->n - 1 && e->leaf[FWD]->next)
+        bt_fix_separator(e->leaf[FWD]->next);
+    if (ri == e->leaf[REV]->n - 1 && e->leaf[REV]->next)
+        bt_fix_separator(e->leaf[REV]->next);
+}
+
+/* find a map entry containing 'lba' or the next higher entry.
+ */
+void *stl_map_lba_geq(void *_maps, lba_t lba)
+{
+    struct map_pair *maps = _maps;
+    int i;
+    struct bt_key key = {.k1 = lba, .k2 = 0};
+    struct bt_node *n = bt_find_leq(&maps->tree[FWD], key, &i);
+    if (n == NULL)
+        return NULL;
+
+    struct entry *e = (i >= 0) ? n->ptr[i] : NULL;
+    if (e == NULL || e->lba + e->len <= lba)
+        e = bt_next(&n, &i);
+    return (e == NULL) ? NULL : e+1;
+}
+
+/* ditto for PBA
+ */
+void *stl_map_pba_geq(void *_maps, pba_t pba)
+{
+    struct map_pair *maps = _maps;
+    int i;
+    struct bt_key key = {.k1 = pba_key(pba), .k2 = INT64_MAX};
+    struct bt_node *n = bt_find_leq(&maps->tree[REV], key, &i);
+    if (n == NULL)
+        return NULL;
+
+    struct entry *e = (i >= 0) ? n->ptr[i] : NULL;
+    if (e == NULL || e->pba.band != pba.band ||
+        e->pba.offset + e->len <= pba.offset)
+        e = bt_next(&n, &i);
+    return (e == NULL) ? NULL : e+1;
+}
+
+static void *bt_iterate(struct map_pair *maps, struct entry *e, int which)
+{
+    struct bt_node *n;
+    int i;
+
+    if (e == NULL) {
+        n = maps->tree[which].first;
+        i = -1;
+    }
+    else {
+        n = e->leaf[which];
+        i = bt_slot(e, which);
+    }
+    if (n == NULL)
+        return NULL;
+    e = bt_next(&n, &i);
+    return (e == NULL) ? NULL : e+1;
+}
+
+/* right-hand iterator - LBA mapping
+ */
+void *stl_map_lba_iterate(void *_maps, void *_e)
+{
+    struct entry *e = _e;
+    if (e != NULL) e--;
+    return bt_iterate(_maps, e, FWD);
+}
+
+/* right-hand iterator - PBA mapping
+ */
+void *stl_map_pba_iterate(void *_maps, void *_e)
+{
+    struct entry *e = _e;
+    if (e != NULL) e--;
+    return bt_iterate(_maps, e, REV);
+}
+
+int  stl_map_count(void *_maps)
+{
+    struct map_pair *maps = _maps;
+    return maps->count;
+}
+
+/* entry allocator counters: live and peak entries, chunks in use
+ */
+void stl_map_alloc_stats(void *_maps, int *live, int *peak, int *chunks)
+{
+    struct map_pair *maps = _maps;
+    *live = maps->entries.live;
+    *peak = maps->entries.peak;
+    *chunks = maps->entries.n_chunks;
+}
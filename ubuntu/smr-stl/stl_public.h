@@ -6,10 +6,41 @@
 
 struct volume;
 struct volume *init_volume(const char *dev);
+#define STL_URING 1             /* io_uring backend, see smr_open_flags */
+struct volume *init_volume_flags(const char *dev, int flags);
 void delete_volume(struct volume *v);
 void host_write(struct volume *v, lba_t lba, const void *buf, int bytes);
 void host_trim(struct volume *v, lba_t lba, int sectors);
 void host_read(struct volume *v, lba_t lba, void *buf, int bytes);
+void host_flush(struct volume *v);
+void volume_batching(struct volume *v, int kbytes, int usecs);
+void volume_cleaner(struct volume *v, int on);
+int volume_policy(struct volume *v, const char *name);
+void volume_frontiers(struct volume *v, int n);
+void volume_sequential(struct volume *v, int kbytes);
+void volume_wcache(struct volume *v, int mbytes);
+void volume_rcache(struct volume *v, int mbytes);
+void volume_checkpoint_interval(struct volume *v, int seqs);
+const char *volume_policy_name(int i);
 int64_t volume_size(struct volume *v);
 
+/* running totals since the volume was opened, in sectors
+ */
+struct volume_stats {
+    int64_t data_sectors;       /* host data and data moved by cleaning */
+    int64_t moved_sectors;      /*  the part moved by cleaning */
+    int64_t disk_sectors;       /* everything, with headers and checkpoints */
+    int64_t checkpoints;
+    int     map_extents;        /* current size of the map */
+};
+void volume_stats(struct volume *v, struct volume_stats *s);
+
+/* model drive timing (see stl_smrsim.h) - returns -1 for bad params.
+ * volume_sim_time is the modeled time in ns, or -1 without a model,
+ * and fills in 'st' if it isn't NULL.
+ */
+struct sim_stats;
+int volume_sim(struct volume *v, const char *params);
+int64_t volume_sim_time(struct volume *v, struct sim_stats *st);
+
 #endif
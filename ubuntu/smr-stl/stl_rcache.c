@@ -0,0 +1,215 @@
+/*
+ * file:        stl_rcache.c
+ * description: read cache of whole physical extents, 2Q eviction
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "stl.h"
+#include "stl_rcache.h"
+
+/* A1in gets a quarter of the space, and A1out remembers as many
+ * extents as would fill half of it (counting each as RC_AVG sectors)
+ */
+#define RC_KIN(max)  ((max) / 4)
+#define RC_AVG 4
+#define RC_KOUT(max) ((max) / 2 / RC_AVG + 1)
+
+struct rcache *rc_init(int sectors, int n_bands)
+{
+    struct rcache *rc = calloc(sizeof(*rc), 1);
+    rc->max = sectors;
+    rc->kin = RC_KIN(sectors);
+    rc->kout = RC_KOUT(sectors);
+    for (rc->hsize = 64; rc->hsize < 2 * (sectors / RC_AVG + rc->kout); )
+        rc->hsize *= 2;
+    rc->hash = calloc(rc->hsize, sizeof(*rc->hash));
+    rc->n_bands = n_bands;
+    rc->band = calloc(n_bands, sizeof(*rc->band));
+    pthread_mutex_init(&rc->lock, NULL);
+    return rc;
+}
+
+static struct rc_entry **rc_bucket(struct rcache *rc, pba_t pba)
+{
+    uint32_t h = pba.band * 2654435761U ^ pba.offset * 40503U;
+    return &rc->hash[(h ^ (h >> 16)) & (rc->hsize - 1)];
+}
+
+static struct rc_entry *rc_find(struct rcache *rc, pba_t pba)
+{
+    struct rc_entry *e = *rc_bucket(rc, pba);
+    while (e != NULL && !pba_eq(e->pba, pba))
+        e = e->h_next;
+    return e;
+}
+
+static int rc_weight(struct rc_entry *e)
+{
+    return (e->q == RC_A1OUT) ? 1 : e->len;
+}
+
+static void q_remove(struct rcache *rc, struct rc_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        rc->head[e->q] = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        rc->tail[e->q] = e->prev;
+    rc->size[e->q] -= rc_weight(e);
+}
+
+/* put at the MRU end of queue 'q'
+ */
+static void q_push(struct rcache *rc, struct rc_entry *e, int q)
+{
+    e->q = q;
+    e->prev = NULL;
+    e->next = rc->head[q];
+    if (e->next)
+        e->next->prev = e;
+    else
+        rc->tail[q] = e;
+    rc->head[q] = e;
+    rc->size[q] += rc_weight(e);
+}
+
+/* remove an entry from everything and free it
+ */
+static void rc_drop(struct rcache *rc, struct rc_entry *e)
+{
+    struct rc_entry **pp = rc_bucket(rc, e->pba);
+    while (*pp != e)
+        pp = &(*pp)->h_next;
+    *pp = e->h_next;
+
+    if (e->b_prev)
+        e->b_prev->b_next = e->b_next;
+    else
+        rc->band[e->pba.band] = e->b_next;
+    if (e->b_next)
+        e->b_next->b_prev = e->b_prev;
+
+    q_remove(rc, e);
+    free(e->buf);
+    free(e);
+}
+
+/* make room for 'len' more sectors of data. Caller holds the lock.
+ */
+static void rc_reclaim(struct rcache *rc, int len)
+{
+    while (rc->size[RC_A1IN] + rc->size[RC_AM] + len > rc->max) {
+        struct rc_entry *e;
+        if (rc->size[RC_A1IN] > rc->kin || rc->tail[RC_AM] == NULL) {
+            /* demote to a ghost on A1out
+             */
+            e = rc->tail[RC_A1IN];
+            q_remove(rc, e);
+            free(e->buf);
+            e->buf = NULL;
+            q_push(rc, e, RC_A1OUT);
+            if (rc->size[RC_A1OUT] > rc->kout)
+                rc_drop(rc, rc->tail[RC_A1OUT]);
+        }
+        else
+            rc_drop(rc, rc->tail[RC_AM]);
+        rc->stats.evictions++;
+    }
+}
+
+/* copy sectors offset..+len of the extent starting at 'pba' into
+ * 'buf', if it's cached. Returns 1 on a hit.
+ */
+int rc_read(struct rcache *rc, pba_t pba, int offset, void *buf, int len)
+{
+    pthread_mutex_lock(&rc->lock);
+    rc->stats.lookups++;
+    struct rc_entry *e = rc_find(rc, pba);
+    if (e == NULL || e->buf == NULL || offset + len > e->len) {
+        rc->stats.misses++;
+        pthread_mutex_unlock(&rc->lock);
+        return 0;
+    }
+    memcpy(buf, e->buf + (int64_t)offset * SECTOR_SIZE,
+           (int64_t)len * SECTOR_SIZE);
+    if (e->q == RC_AM) {
+        q_remove(rc, e);
+        q_push(rc, e, RC_AM);
+    }
+    rc->stats.hits++;
+    rc->stats.hit_sectors += len;
+    pthread_mutex_unlock(&rc->lock);
+    return 1;
+}
+
+/* add an extent that was just read from disk. Extents remembered on
+ * A1out have been read twice recently and go straight to Am.
+ */
+void rc_insert(struct rcache *rc, pba_t pba, int len, const void *buf)
+{
+    int q = RC_A1IN;
+    if (len > rc->kin)
+        return;
+
+    pthread_mutex_lock(&rc->lock);
+    struct rc_entry *e = rc_find(rc, pba);
+    if (e != NULL && e->buf != NULL && e->len >= len) {
+        pthread_mutex_unlock(&rc->lock);
+        return;
+    }
+    if (e != NULL) {
+        if (e->q == RC_A1OUT)
+            q = RC_AM;
+        rc_drop(rc, e);
+    }
+    rc_reclaim(rc, len);
+
+    e = calloc(sizeof(*e), 1);
+    e->pba = pba;
+    e->len = len;
+    e->buf = malloc((int64_t)len * SECTOR_SIZE);
+    memcpy(e->buf, buf, (int64_t)len * SECTOR_SIZE);
+
+    struct rc_entry **pp = rc_bucket(rc, pba);
+    e->h_next = *pp;
+    *pp = e;
+    e->b_next = rc->band[pba.band];
+    if (e->b_next)
+        e->b_next->b_prev = e;
+    rc->band[pba.band] = e;
+    q_push(rc, e, q);
+    rc->stats.fill_sectors += len;
+    pthread_mutex_unlock(&rc->lock);
+}
+
+/* the band is being reset - anything cached from it is garbage
+ */
+void rc_invalidate_band(struct rcache *rc, int band)
+{
+    assert(band >= 0 && band < rc->n_bands);
+    pthread_mutex_lock(&rc->lock);
+    while (rc->band[band] != NULL) {
+        rc_drop(rc, rc->band[band]);
+        rc->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
+
+void rc_destroy(struct rcache *rc)
+{
+    int q;
+    for (q = 0; q < RC_NQ; q++)
+        while (rc->head[q] != NULL)
+            rc_drop(rc, rc->head[q]);
+    pthread_mutex_destroy(&rc->lock);
+    free(rc->hash);
+    free(rc->band);
+    free(rc);
+}
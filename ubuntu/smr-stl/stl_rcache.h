@@ -0,0 +1,59 @@
+/*
+ * file:        stl_rcache.h
+ * description: read cache of whole physical extents
+ */
+#ifndef __STL_RCACHE_H__
+#define __STL_RCACHE_H__
+
+#include <pthread.h>
+
+/* Entries are whole extents, keyed by the PBA they start at. Data at
+ * a PBA never changes until its band is reset, so entries stay valid
+ * however the LBAs get remapped, and are only dropped by eviction or
+ * rc_invalidate_band().
+ *
+ * Eviction is 2Q (Johnson & Shasha): extents come in on a FIFO
+ * (A1in) holding RC_KIN of the space, and only get promoted to the
+ * LRU (Am) if they're read again after falling off it - A1out
+ * remembers the keys of recently evicted A1in entries. A scan passes
+ * through A1in without disturbing Am.
+ */
+enum {RC_A1IN, RC_AM, RC_A1OUT, RC_NQ};
+
+struct rc_entry {
+    pba_t    pba;
+    int      len;               /* sectors */
+    int      q;                 /* queue it's on */
+    void    *buf;               /* NULL on A1out */
+    struct rc_entry *h_next;    /* hash chain */
+    struct rc_entry *prev, *next;       /* queue, MRU first */
+    struct rc_entry *b_prev, *b_next;   /* band list */
+};
+
+struct rc_stats {
+    int64_t lookups, hits, misses;
+    int64_t hit_sectors, fill_sectors;
+    int64_t evictions, invalidations;
+};
+
+struct rcache {
+    int      max;               /* sectors of data cached, total */
+    int      kin;               /*  of which A1in */
+    int      kout;              /* entries remembered on A1out */
+    int      size[RC_NQ];       /* sectors (A1in, Am), entries (A1out) */
+    struct rc_entry *head[RC_NQ], *tail[RC_NQ];
+    struct rc_entry **hash;
+    int      hsize;             /* power of 2 */
+    struct rc_entry **band;     /* entries per band */
+    int      n_bands;
+    struct rc_stats stats;
+    pthread_mutex_t lock;
+};
+
+struct rcache *rc_init(int sectors, int n_bands);
+int rc_read(struct rcache *rc, pba_t pba, int offset, void *buf, int len);
+void rc_insert(struct rcache *rc, pba_t pba, int len, const void *buf);
+void rc_invalidate_band(struct rcache *rc, int band);
+void rc_destroy(struct rcache *rc);
+
+#endif
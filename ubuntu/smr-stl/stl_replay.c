@@ -0,0 +1,472 @@
+/*
+ * file:        stl_replay.c
+ * description: replay a block trace against an STL volume
+ *
+ * usage: replay [options] <image> <trace>
+ *
+ * Trace formats (--format, or detected from the first line):
+ *   fio      - fio iolog, version 2 or 3 (what the skylight mktrace.py
+ *              scripts and fio's write_iolog produce). Byte offsets.
+ *   blkparse - blkparse default text output. Only events with action
+ *              --event (default Q) are used; 512-byte sectors.
+ *   stl      - stl_test commands: write/read/verify/trim <lba> <len>,
+ *              flush. 4K sectors.
+ * Requests go to the volume as fast as possible - timestamps and
+ * fio 'wait' entries are ignored. With -sim=<params> the device is a
+ * modeled drive (stl_smrsim.h) and latencies are modeled time.
+ * Offsets past the end of the volume wrap around. Partial sectors are
+ * rounded out to whole 4K sectors, except for TRIM, which is rounded in.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "stl.h"
+#include "stl_public.h"
+#include "stl_smrsim.h"
+
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+
+enum {FMT_AUTO, FMT_FIO, FMT_BLKPARSE, FMT_STL};
+static char *fmt_names[] = {"auto", "fio", "blkparse", "stl"};
+
+enum {OP_READ, OP_WRITE, OP_TRIM, OP_FLUSH, N_OPS};
+static char *op_names[] = {"read", "write", "trim", "flush"};
+
+struct option opts[] = {
+    {.name = "format",    required_argument, 0, 'F'},
+    {.name = "event",     required_argument, 0, 'e'},
+    {.name = "interval",  required_argument, 0, 'i'},
+    {.name = "policy",    required_argument, 0, 'p'},
+    {.name = "frontiers", required_argument, 0, 'f'},
+    {.name = "cleaner",   required_argument, 0, 'c'},
+    {.name = "batch",     required_argument, 0, 'b'},
+    {.name = "wcache",    required_argument, 0, 'w'},
+    {.name = "rcache",    required_argument, 0, 'r'},
+    {.name = "uring",     no_argument,       0, 'u'},
+    {.name = "sim",       required_argument, 0, 's'},
+    {.name = "verbose",   no_argument,       0, 'v'},
+    {0,                   0,                 0,  0}
+};
+
+/* latency histogram: 4 buckets per power of two of nanoseconds, so
+ * percentiles are within 25%
+ */
+#define HIST_SUB 4
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct op_stats {
+    int64_t n, sectors;
+    int64_t total_ns, max_ns;
+    int64_t hist[HIST_BUCKETS];
+};
+
+static struct op_stats stats[N_OPS];
+static FILE *out;               /* the report - stdout is the STL's */
+
+static int hist_bucket(int64_t ns)
+{
+    int b = 63 - __builtin_clzll(ns | 1);
+    if (b < 2)
+        return ns;
+    return b * HIST_SUB + ((ns >> (b - 2)) & (HIST_SUB - 1));
+}
+
+/* upper bound of a bucket
+ */
+static int64_t hist_value(int i)
+{
+    int b = i / HIST_SUB, sub = i % HIST_SUB;
+    if (b < 2)
+        return i + 1;
+    return ((int64_t)(HIST_SUB + sub + 1)) << (b - 2);
+}
+
+/* nearest rank, to within a bucket
+ */
+static int64_t hist_pct(struct op_stats *s, double pct)
+{
+    int64_t i, sum = 0, rank = max(1, (int64_t)(s->n * pct / 100.0 + 0.999999));
+    for (i = 0; i < HIST_BUCKETS; i++)
+        if ((sum += s->hist[i]) >= rank)
+            return min(hist_value(i), s->max_ns);
+    return s->max_ns;
+}
+
+static int64_t nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*------------ Trace parsing -----------*/
+
+struct op {
+    int op;
+    int64_t offset, len;        /* bytes */
+};
+
+static int op_type(const char *rw)
+{
+    if (!strcmp(rw, "read"))
+        return OP_READ;
+    if (!strcmp(rw, "write"))
+        return OP_WRITE;
+    if (!strcmp(rw, "trim"))
+        return OP_TRIM;
+    if (!strcmp(rw, "sync") || !strcmp(rw, "datasync"))
+        return OP_FLUSH;
+    return -1;
+}
+
+/* fio iolog v2: '<file> <action> [<offset> <length>]', v3 adds a
+ * timestamp in front. add/open/close/wait are skipped.
+ */
+static int parse_fio(char *line, int version, struct op *op)
+{
+    char file[256], rw[32];
+    long long t, off = 0, len = 0;
+    int n;
+    if (version >= 3)
+        n = sscanf(line, "%lld %255s %31s %lld %lld", &t, file, rw, &off, &len) - 1;
+    else
+        n = sscanf(line, "%255s %31s %lld %lld", file, rw, &off, &len);
+    if (n < 2 || (op->op = op_type(rw)) < 0)
+        return 0;
+    if (op->op != OP_FLUSH && n < 4)
+        return 0;
+    op->offset = off;
+    op->len = len;
+    return 1;
+}
+
+/* blkparse: 'maj,min cpu seq time pid action rwbs sector + n [proc]'
+ */
+static int parse_blkparse(char *line, char event, struct op *op)
+{
+    char action[8], rwbs[8];
+    long long sector = 0, n = 0;
+    int maj, min, cpu, pid;
+    unsigned seq;
+    double t;
+    int k = sscanf(line, "%d,%d %d %u %lf %d %7s %7s %lld + %lld", &maj,
+                   &min, &cpu, &seq, &t, &pid, action, rwbs, &sector, &n);
+    if (k < 8 || action[0] != event || action[1] != 0)
+        return 0;
+    if (k < 10) {               /* no data - only an empty flush counts */
+        if (strchr(rwbs, 'F') == NULL)
+            return 0;
+        op->op = OP_FLUSH;
+        sector = n = 0;
+    }
+    else if (strchr(rwbs, 'D'))
+        op->op = OP_TRIM;
+    else if (strchr(rwbs, 'W'))
+        op->op = OP_WRITE;
+    else if (strchr(rwbs, 'R'))
+        op->op = OP_READ;
+    else
+        return 0;
+    op->offset = sector * 512;
+    op->len = n * 512;
+    return 1;
+}
+
+/* stl_test scripts, in 4K sectors
+ */
+static int parse_stl(char *line, struct op *op)
+{
+    char cmd[32];
+    long long lba = 0, len = 0;
+    int n = sscanf(line, "%31s %lld %lld", cmd, &lba, &len);
+    if (n < 1)
+        return 0;
+    if (!strcmp(cmd, "flush"))
+        op->op = OP_FLUSH;
+    else if (n < 3)
+        return 0;
+    else if (!strcmp(cmd, "verify"))
+        op->op = OP_READ;
+    else if ((op->op = op_type(cmd)) < 0 || op->op == OP_FLUSH)
+        return 0;
+    op->offset = lba * SECTOR_SIZE;
+    op->len = len * SECTOR_SIZE;
+    return 1;
+}
+
+static int detect_format(const char *line, int *version)
+{
+    int maj, min;
+    if (sscanf(line, "fio version %d iolog", version) == 1)
+        return FMT_FIO;
+    if (sscanf(line, "%d,%d", &maj, &min) == 2)
+        return FMT_BLKPARSE;
+    return FMT_STL;
+}
+
+/*------------ Replay -----------*/
+
+static void print_sample(int64_t ops, int64_t host, struct volume_stats *s)
+{
+    double mb = SECTOR_SIZE / (1024.0 * 1024);
+    fprintf(out, "%10lld %10.1f %10.1f %10.1f %6.2f %8d\n", (long long)ops,
+            host * mb, s->disk_sectors * mb, s->moved_sectors * mb,
+            host ? (double)s->disk_sectors / host : 0.0, s->map_extents);
+}
+
+static void usage(char *cmd)
+{
+    int i;
+    fprintf(stderr, "usage: %s [options] <image> <trace>\n options = ", cmd);
+    char *s = "";
+    for (i = 0; opts[i].name; i++) {
+        fprintf(stderr, "%s-%s\n", s, opts[i].name);
+        s = "           ";
+    }
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, opt_index, format = FMT_AUTO, version = 2, interval = 10000;
+    int frontiers = 0, cleaner = 0, batch = 0, wcache = 0, rcache = 0;
+    int flags = 0, verbose = 0;
+    char event = 'Q', *policy = NULL, *sim = NULL;
+
+    while ((c = getopt_long_only(argc, argv, "", opts, &opt_index)) != -1) {
+        switch (c) {
+        case 'F':
+            for (format = 0; format <= FMT_STL; format++)
+                if (!strcmp(optarg, fmt_names[format]))
+                    break;
+            if (format > FMT_STL)
+                usage(argv[0]);
+            break;
+        case 'e': event = optarg[0]; break;
+        case 'i': interval = atoi(optarg); break;
+        case 'p': policy = optarg; break;
+        case 'f': frontiers = atoi(optarg); break;
+        case 'c': cleaner = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        case 'w': wcache = atoi(optarg); break;
+        case 'r': rcache = atoi(optarg); break;
+        case 'u': flags |= STL_URING; break;
+        case 's': sim = optarg; break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 2 != argc)
+        usage(argv[0]);
+
+    FILE *fp = fopen(argv[optind+1], "r");
+    if (fp == NULL) {
+        perror(argv[optind+1]);
+        exit(1);
+    }
+
+    /* the STL prints debugging to stdout, which would swamp the report
+     * (and the latencies). Keep it only with -verbose.
+     */
+    out = fdopen(dup(1), "w");
+    if (!verbose)
+        freopen("/dev/null", "w", stdout);
+
+    struct volume *v = init_volume_flags(argv[optind], flags);
+    if (v == NULL) {
+        fprintf(stderr, "can't open %s\n", argv[optind]);
+        exit(1);
+    }
+    if (policy != NULL && volume_policy(v, policy) < 0) {
+        fprintf(stderr, "unknown policy %s\n", policy);
+        exit(1);
+    }
+    if (frontiers > 0)
+        volume_frontiers(v, frontiers);
+    if (batch > 0)
+        volume_batching(v, batch, 1000);
+    if (wcache > 0)
+        volume_wcache(v, wcache);
+    if (rcache > 0)
+        volume_rcache(v, rcache);
+    if (cleaner)
+        volume_cleaner(v, 1);
+    if (sim != NULL && volume_sim(v, sim) < 0) {
+        fprintf(stderr, "bad sim parameters %s\n", sim);
+        exit(1);
+    }
+
+    int64_t vol_sectors = volume_size(v) / SECTOR_SIZE;
+    int64_t n_ops = 0, skipped = 0, wrapped = 0, host_written = 0;
+    int64_t buf_sectors = 256;
+    void *buf = valloc(buf_sectors * SECTOR_SIZE);
+    struct volume_stats s0, s;
+    char line[1024];
+
+    volume_stats(v, &s0);       /* don't count mount's checkpoint */
+    fprintf(out, "# %8s %10s %10s %10s %6s %8s\n", "ops", "host_MB",
+            "disk_MB", "moved_MB", "WA", "extents");
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct op op;
+        int ok;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (format == FMT_AUTO)
+            format = detect_format(line, &version);
+        if (format == FMT_FIO &&
+            sscanf(line, "fio version %d iolog", &version) == 1)
+            continue;           /* the version line */
+        if (format == FMT_FIO)
+            ok = parse_fio(line, version, &op);
+        else if (format == FMT_BLKPARSE)
+            ok = parse_blkparse(line, event, &op);
+        else
+            ok = parse_stl(line, &op);
+        if (!ok) {
+            skipped++;
+            continue;
+        }
+
+        /* round out to whole sectors (TRIM rounds in) and wrap
+         */
+        lba_t lba = op.offset / SECTOR_SIZE;
+        int64_t end = (op.offset + op.len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (op.op == OP_TRIM) {
+            lba = (op.offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            end = (op.offset + op.len) / SECTOR_SIZE;
+        }
+        int64_t sectors = max(end - lba, 0);
+        if (lba >= vol_sectors) {
+            lba %= vol_sectors;
+            wrapped++;
+        }
+        sectors = min(sectors, vol_sectors - lba);
+        if (sectors == 0 && op.op != OP_FLUSH) {
+            skipped++;
+            continue;
+        }
+        if ((op.op == OP_READ || op.op == OP_WRITE) && sectors > buf_sectors) {
+            free(buf);
+            buf_sectors = sectors;
+            buf = valloc(buf_sectors * SECTOR_SIZE);
+        }
+        if (op.op == OP_WRITE)
+            memset(buf, lba & 0xff, sectors * SECTOR_SIZE);
+
+        int64_t t0 = sim ? volume_sim_time(v, NULL) : nsecs();
+        switch (op.op) {
+        case OP_READ:
+            host_read(v, lba, buf, sectors * SECTOR_SIZE);
+            break;
+        case OP_WRITE:
+            host_write(v, lba, buf, sectors * SECTOR_SIZE);
+            host_written += sectors;
+            break;
+        case OP_TRIM:
+            host_trim(v, lba, sectors);
+            break;
+        case OP_FLUSH:
+            host_flush(v);
+            break;
+        }
+        int64_t t = (sim ? volume_sim_time(v, NULL) : nsecs()) - t0;
+
+        struct op_stats *st = &stats[op.op];
+        st->n++;
+        st->sectors += sectors;
+        st->total_ns += t;
+        st->max_ns = max(st->max_ns, t);
+        st->hist[hist_bucket(t)]++;
+
+        if (++n_ops % interval == 0) {
+            volume_stats(v, &s);
+            s.disk_sectors -= s0.disk_sectors;
+            s.moved_sectors -= s0.moved_sectors;
+            print_sample(n_ops, host_written, &s);
+        }
+    }
+    fclose(fp);
+
+    /* the final flush counts towards what the trace cost
+     */
+    host_flush(v);
+    volume_stats(v, &s);
+    s.data_sectors -= s0.data_sectors;
+    s.moved_sectors -= s0.moved_sectors;
+    s.disk_sectors -= s0.disk_sectors;
+    s.checkpoints -= s0.checkpoints;
+    print_sample(n_ops, host_written, &s);
+
+    double mb = SECTOR_SIZE / (1024.0 * 1024);
+    fprintf(out, "\ntrace %s (%s): %lld ops, %lld lines skipped, "
+            "%lld wrapped\n", argv[optind+1], fmt_names[format],
+            (long long)n_ops, (long long)skipped, (long long)wrapped);
+    fprintf(out, "host: written %.1f MB, read %.1f MB, trimmed %.1f MB\n",
+            stats[OP_WRITE].sectors * mb, stats[OP_READ].sectors * mb,
+            stats[OP_TRIM].sectors * mb);
+    fprintf(out, "disk: written %.1f MB - data %.1f MB (cleaning %.1f MB), "
+            "headers and checkpoints %.1f MB\n", s.disk_sectors * mb,
+            s.data_sectors * mb, s.moved_sectors * mb,
+            (s.disk_sectors - s.data_sectors) * mb);
+    fprintf(out, "write amplification %.2f, %lld checkpoints, map %d extents\n",
+            host_written ? (double)s.disk_sectors / host_written : 0.0,
+            (long long)s.checkpoints, s.map_extents);
+
+    int i, j;
+    if (sim != NULL) {
+        struct sim_stats ss;
+        int64_t t = volume_sim_time(v, &ss);
+        fprintf(out, "drive model (%s): %.3f s - seek %.3f, rotation %.3f, "
+                "transfer %.3f; %lld seeks\n", sim, t / 1e9, ss.seek_ns / 1e9,
+                ss.rotate_ns / 1e9, ss.xfer_ns / 1e9, (long long)ss.seeks);
+        if (ss.mc_writes > 0)
+            fprintf(out, "media cache: %lld writes, %lld bands cleaned "
+                    "in %.3f s\n", (long long)ss.mc_writes,
+                    (long long)ss.mc_cleans, ss.mc_clean_ns / 1e9);
+    }
+    fprintf(out, "\n%-12s %10s %8s %8s %8s %8s %8s %8s\n",
+            sim ? "modeled (us)" : "latency (us)", "ops", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < N_OPS; i++) {
+        struct op_stats *st = &stats[i];
+        if (st->n == 0)
+            continue;
+        fprintf(out, "%-12s %10lld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+                op_names[i], (long long)st->n, st->total_ns / 1000.0 / st->n,
+                hist_pct(st, 50) / 1000.0, hist_pct(st, 90) / 1000.0,
+                hist_pct(st, 99) / 1000.0, hist_pct(st, 99.9) / 1000.0,
+                st->max_ns / 1000.0);
+    }
+
+    /* histograms, one line per power of two
+     */
+    for (i = 0; i < N_OPS; i++) {
+        struct op_stats *st = &stats[i];
+        if (st->n == 0)
+            continue;
+        fprintf(out, "\n%s %s histogram (us):\n", op_names[i],
+                sim ? "modeled latency" : "latency");
+        for (j = 0; j < HIST_BUCKETS; j += HIST_SUB) {
+            int64_t k, n = 0;
+            for (k = j; k < j + HIST_SUB; k++)
+                n += st->hist[k];
+            if (n == 0)
+                continue;
+            fprintf(out, "  < %10.1f %10lld %5.1f%%\n",
+                    hist_value(j + HIST_SUB - 1) / 1000.0, (long long)n,
+                    100.0 * n / st->n);
+        }
+    }
+    fflush(out);
+
+    delete_volume(v);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * file:        stl_slab.c
+ * description: fixed-size object arena for map entries
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "stl_slab.h"
+
+#define SLAB_CHUNK_SIZE (256*1024)
+
+/* the first pointer-sized word of each chunk links the chunk list,
+ * objects start after it.
+ */
+#define CHUNK_HDR sizeof(void*)
+
+void slab_init(struct slab *s, int obj_size)
+{
+    memset(s, 0, sizeof(*s));
+    s->obj_size = (obj_size + 7) & ~7;
+    if (s->obj_size < sizeof(void*))
+        s->obj_size = sizeof(void*);
+    s->per_chunk = (SLAB_CHUNK_SIZE - CHUNK_HDR) / s->obj_size;
+    assert(s->per_chunk > 0);
+}
+
+void *slab_alloc(struct slab *s)
+{
+    void *obj;
+    if (s->free != NULL) {
+        obj = s->free;
+        s->free = *(void**)obj;
+    }
+    else {
+        if (s->n_left == 0) {
+            void **chunk = malloc(SLAB_CHUNK_SIZE);
+            assert(chunk != NULL);
+            *chunk = s->chunks;
+            s->chunks = chunk;
+            s->n_chunks++;
+            s->next = (char*)chunk + CHUNK_HDR;
+            s->n_left = s->per_chunk;
+        }
+        obj = s->next;
+        s->next += s->obj_size;
+        s->n_left--;
+    }
+    if (++s->live > s->peak)
+        s->peak = s->live;
+    return obj;
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->live--;
+}
+
+/* release every object at once - O(chunks), not O(objects)
+ */
+void slab_destroy(struct slab *s)
+{
+    void *chunk = s->chunks;
+    while (chunk != NULL) {
+        void *tmp = *(void**)chunk;
+        free(chunk);
+        chunk = tmp;
+    }
+    memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,29 @@
+/*
+ * file:        stl_slab.h
+ * description: fixed-size object arena for map entries
+ */
+#ifndef __STL_SLAB_H__
+#define __STL_SLAB_H__
+
+/* objects are carved out of large chunks and recycled through a free
+ * list, so extent churn never reaches malloc/free. All memory is
+ * released at once by slab_destroy.
+ */
+struct slab {
+    int    obj_size;            /* bytes, rounded up for alignment */
+    int    per_chunk;           /* objects per chunk */
+    void  *chunks;              /* linked through first word */
+    void  *free;                /* free objects, linked through first word */
+    char  *next;                /* unused tail of the newest chunk */
+    int    n_left;              /* objects left at 'next' */
+    int    n_chunks;
+    int    live;                /* allocated objects */
+    int    peak;
+};
+
+void slab_init(struct slab *s, int obj_size);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+void slab_destroy(struct slab *s);
+
+#endif
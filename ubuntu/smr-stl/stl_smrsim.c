@@ -0,0 +1,277 @@
+/*
+ * file:        stl_smrsim.c
+ * description: SMR drive timing model - seek, rotation, zoned
+ *              bandwidth and a persistent media cache
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "stl_smrsim.h"
+
+#define SECTOR_SIZE 4096
+
+/* defaults are roughly the Seagate 8TB archive drive: 5900 RPM, about
+ * 190MB/s outside and half that inside. No media cache - the STL
+ * expects a host-managed drive.
+ */
+#define SIM_RPM        5900
+#define SIM_SEEK_MIN   1.0      /* ms, track to track */
+#define SIM_SEEK_MAX   22.0     /* ms, full stroke */
+#define SIM_CMD_US     20
+#define SIM_BW_OUTER   190      /* MB/s */
+#define SIM_BW_INNER   95
+
+static double mb_per_sec(double mbs)
+{
+    return mbs * (1024 * 1024 / SECTOR_SIZE) / 1e9; /* sectors per ns */
+}
+
+/* parse 'key=value,...' over the defaults. -1 on an unknown key
+ */
+static int sim_params(struct smr_sim *s, const char *params)
+{
+    double rpm = SIM_RPM, seek_min = SIM_SEEK_MIN, seek_max = SIM_SEEK_MAX;
+    double cmd_us = SIM_CMD_US, bw_outer = SIM_BW_OUTER, bw_inner = SIM_BW_INNER;
+    double track_kb = 0, capacity_gb = 0, mc_mb = 0, mc_bypass_kb = 0;
+    char *tmp = strdup(params ? params : ""), *ptr = tmp, *p;
+
+    while ((p = strsep(&ptr, ",")) != NULL) {
+        char *key = strsep(&p, "=");
+        double val = p ? atof(p) : 0;
+        if (*key == '\0' || !strcmp(key, "default"))
+            continue;
+        if (!strcmp(key, "rpm"))
+            rpm = val;
+        else if (!strcmp(key, "seek_min"))
+            seek_min = val;
+        else if (!strcmp(key, "seek_max"))
+            seek_max = val;
+        else if (!strcmp(key, "cmd_us"))
+            cmd_us = val;
+        else if (!strcmp(key, "bw_outer"))
+            bw_outer = val;
+        else if (!strcmp(key, "bw_inner"))
+            bw_inner = val;
+        else if (!strcmp(key, "track_kb"))
+            track_kb = val;
+        else if (!strcmp(key, "capacity_gb"))
+            capacity_gb = val;
+        else if (!strcmp(key, "mc_mb"))
+            mc_mb = val;
+        else if (!strcmp(key, "mc_bypass_kb"))
+            mc_bypass_kb = val;
+        else {
+            printf("smrsim: unknown parameter %s\n", key);
+            free(tmp);
+            return -1;
+        }
+    }
+    free(tmp);
+    if (rpm <= 0 || bw_outer <= 0 || bw_inner <= 0)
+        return -1;
+
+    s->rev_ns = 60e9 / rpm;
+    s->seek_min = seek_min * 1e6;
+    s->seek_max = seek_max * 1e6;
+    s->cmd_ns = cmd_us * 1e3;
+    s->bw_outer = mb_per_sec(bw_outer);
+    s->bw_inner = mb_per_sec(bw_inner);
+    s->track_outer = track_kb > 0 ? track_kb * 1024 / SECTOR_SIZE :
+        s->bw_outer * s->rev_ns;
+    s->mc_sectors = mc_mb * 1024 * 1024 / SECTOR_SIZE;
+    s->mc_bypass = mc_bypass_kb > 0 ? mc_bypass_kb * 1024 / SECTOR_SIZE :
+        s->track_outer;
+    s->capacity = s->mc_sectors + (int64_t)s->n_bands * s->band_size;
+    if (capacity_gb * 1024 * 1024 / 4 > s->capacity)
+        s->capacity = capacity_gb * 1024 * 1024 / 4;
+    return 0;
+}
+
+struct smr_sim *sim_create(int n_bands, int band_size, const char *params)
+{
+    struct smr_sim *s = calloc(sizeof(*s), 1);
+    int i;
+    s->n_bands = n_bands;
+    s->band_size = band_size;
+    if (sim_params(s, params) < 0) {
+        free(s);
+        return NULL;
+    }
+    s->mc_lo = malloc(n_bands * sizeof(int));
+    s->mc_hi = calloc(n_bands, sizeof(int));
+    s->mc_pos = calloc(n_bands, sizeof(int64_t));
+    for (i = 0; i < n_bands; i++)
+        s->mc_lo[i] = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+void sim_destroy(struct smr_sim *s)
+{
+    pthread_mutex_destroy(&s->lock);
+    free(s->mc_lo);
+    free(s->mc_hi);
+    free(s->mc_pos);
+    free(s);
+}
+
+/* position of a band sector - the media cache is outside band 0
+ */
+static int64_t sim_pos(struct smr_sim *s, unsigned band, unsigned offset)
+{
+    return s->mc_sectors + (int64_t)band * s->band_size + offset;
+}
+
+static double sim_bw(struct smr_sim *s, int64_t pos)
+{
+    double frac = (double)pos / s->capacity;
+    return s->bw_outer + (s->bw_inner - s->bw_outer) * frac;
+}
+
+static double sim_track(struct smr_sim *s, int64_t pos)
+{
+    return s->track_outer * sim_bw(s, pos) / s->bw_outer;
+}
+
+/* one media access of 'n' sectors at 'pos'. Called with the lock.
+ */
+static void sim_access(struct smr_sim *s, int64_t pos, int64_t n)
+{
+    struct sim_stats *st = &s->stats;
+    double track = sim_track(s, pos);
+    int64_t t = s->now + s->cmd_ns;
+
+    if (pos != s->head) {
+        int64_t dist = llabs(pos - s->head);
+        if (dist >= track) {
+            int64_t seek = s->seek_min + (s->seek_max - s->seek_min) *
+                sqrt((double)dist / s->capacity);
+            st->seeks++;
+            st->seek_ns += seek;
+            t += seek;
+        }
+        /* wait for the sector to come round
+         */
+        double want = fmod(pos / track, 1.0);
+        double angle = (double)(t % s->rev_ns) / s->rev_ns;
+        int64_t wait = fmod(want - angle + 1.0, 1.0) * s->rev_ns;
+        st->rotate_ns += wait;
+        t += wait;
+    }
+    int64_t xfer = n / sim_bw(s, pos);
+    st->xfer_ns += xfer;
+    s->now = t + xfer;
+    s->head = pos + n;
+}
+
+/* read-modify-write of the band with the most cached data
+ */
+static void mc_clean(struct smr_sim *s)
+{
+    int i, b = -1;
+    for (i = 0; i < s->n_bands; i++)
+        if (s->mc_lo[i] >= 0 &&
+            (b < 0 || s->mc_hi[i] - s->mc_lo[i] > s->mc_hi[b] - s->mc_lo[b]))
+            b = i;
+    assert(b >= 0);
+
+    int64_t t0 = s->now, n = s->mc_hi[b] - s->mc_lo[b];
+    sim_access(s, s->mc_pos[b], n);
+    sim_access(s, sim_pos(s, b, 0), s->band_size);
+    sim_access(s, sim_pos(s, b, 0), s->band_size);
+    s->mc_used -= n;
+    s->mc_lo[b] = -1;
+    s->stats.mc_cleans++;
+    s->stats.mc_clean_ns += s->now - t0;
+}
+
+void sim_write(struct smr_sim *s, unsigned band, unsigned offset, unsigned n)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stats.writes++;
+    s->stats.write_sectors += n;
+    if (s->mc_sectors == 0 || n > s->mc_sectors ||
+        (n >= s->mc_bypass && s->mc_lo[band] < 0))
+        sim_access(s, sim_pos(s, band, offset), n);
+    else {
+        while (s->mc_used + n > s->mc_sectors)
+            mc_clean(s);
+        if (s->mc_wp + n > s->mc_sectors)
+            s->mc_wp = 0;
+        sim_access(s, s->mc_wp, n);
+        if (s->mc_lo[band] < 0)
+            s->mc_lo[band] = offset;
+        s->mc_hi[band] = offset + n;
+        s->mc_pos[band] = s->mc_wp;
+        s->mc_wp += n;
+        s->mc_used += n;
+        s->stats.mc_writes++;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* the part of a band at or past mc_lo is read from the cache
+ */
+void sim_read(struct smr_sim *s, unsigned band, unsigned offset, unsigned n)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stats.reads++;
+    s->stats.read_sectors += n;
+    int lo = s->mc_lo[band];
+    if (lo < 0 || offset + n <= lo)
+        sim_access(s, sim_pos(s, band, offset), n);
+    else {
+        if (offset < lo)
+            sim_access(s, sim_pos(s, band, offset), lo - offset);
+        int start = (offset < lo) ? lo : offset;
+        sim_access(s, s->mc_pos[band], offset + n - start);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void sim_reset(struct smr_sim *s, unsigned band)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->mc_lo[band] >= 0) {
+        s->mc_used -= s->mc_hi[band] - s->mc_lo[band];
+        s->mc_lo[band] = -1;
+    }
+    s->now += s->cmd_ns;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* current virtual time, and a copy of the stats if 'st' != NULL
+ */
+int64_t sim_time(struct smr_sim *s, struct sim_stats *st)
+{
+    pthread_mutex_lock(&s->lock);
+    int64_t t = s->now;
+    if (st != NULL)
+        *st = s->stats;
+    pthread_mutex_unlock(&s->lock);
+    return t;
+}
+
+void sim_print(struct smr_sim *s)
+{
+    pthread_mutex_lock(&s->lock);
+    struct sim_stats *st = &s->stats;
+    printf("modeled time: %.3f s (seek %.3f, rotation %.3f, transfer %.3f)\n",
+           s->now / 1e9, st->seek_ns / 1e9, st->rotate_ns / 1e9,
+           st->xfer_ns / 1e9);
+    printf("modeled I/O: %lld reads (%lld sectors), %lld writes (%lld sectors),"
+           " %lld seeks\n", (long long)st->reads, (long long)st->read_sectors,
+           (long long)st->writes, (long long)st->write_sectors,
+           (long long)st->seeks);
+    if (s->mc_sectors > 0)
+        printf("media cache: %lld writes, %lld bands cleaned in %.3f s,"
+               " %lld of %lld sectors used\n", (long long)st->mc_writes,
+               (long long)st->mc_cleans, st->mc_clean_ns / 1e9,
+               (long long)s->mc_used, (long long)s->mc_sectors);
+    pthread_mutex_unlock(&s->lock);
+}
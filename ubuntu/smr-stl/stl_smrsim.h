@@ -0,0 +1,66 @@
+/*
+ * file:        stl_smrsim.h
+ * description: SMR drive timing model for the fake SMR device
+ */
+#ifndef __STL_SMRSIM_H__
+#define __STL_SMRSIM_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* The model keeps a virtual clock and a head position, and charges
+ * each request command overhead, a seek, rotational latency and the
+ * transfer at the bandwidth of its zone:
+ * - positions run from the outer edge (the media cache, then band 0)
+ *   inwards, spread over 'capacity' so a small image can stand for
+ *   the outer part of a big drive.
+ * - bandwidth falls linearly from bw_outer to bw_inner, and track
+ *   size with it.
+ * - a seek costs seek_min + (seek_max - seek_min) * sqrt(distance as
+ *   a fraction of the stroke); none within a track.
+ * - the platter angle is the virtual time modulo a revolution, so
+ *   rotational latency is exact and repeatable. A request that starts
+ *   where the last one ended streams without waiting.
+ * - with a media cache (mc_sectors > 0), writes shorter than
+ *   mc_bypass, and any later writes to a band with cached data, go to
+ *   a log at the outer edge like the persistent cache Skylight found
+ *   in drive-managed disks. When it fills, the band with the most
+ *   cached data is cleaned by read-modify-write of the whole band.
+ * Requests from all threads go through one clock - a single actuator.
+ */
+struct sim_stats {
+    int64_t reads, writes;
+    int64_t read_sectors, write_sectors;
+    int64_t seeks, seek_ns, rotate_ns, xfer_ns;
+    int64_t mc_writes, mc_cleans, mc_clean_ns;
+};
+
+struct smr_sim {
+    int      n_bands, band_size;
+    int64_t  rev_ns;            /* one revolution */
+    int64_t  seek_min, seek_max, cmd_ns;
+    double   bw_outer, bw_inner; /* sectors per ns */
+    double   track_outer;       /* sectors */
+    int64_t  capacity;          /* sectors the positions are spread over */
+    int64_t  mc_sectors;        /* media cache, 0 = none */
+    int64_t  mc_bypass;         /*  writes this long go to the band */
+
+    int64_t  now;               /* virtual time, ns */
+    int64_t  head;              /* position after the last request */
+    int64_t  mc_used, mc_wp;
+    int     *mc_lo, *mc_hi;     /* cached part of each band, lo = -1 if none */
+    int64_t *mc_pos;            /*  and where it was last written */
+    struct sim_stats stats;
+    pthread_mutex_t lock;
+};
+
+struct smr_sim *sim_create(int n_bands, int band_size, const char *params);
+void sim_destroy(struct smr_sim *s);
+void sim_read(struct smr_sim *s, unsigned band, unsigned offset, unsigned n);
+void sim_write(struct smr_sim *s, unsigned band, unsigned offset, unsigned n);
+void sim_reset(struct smr_sim *s, unsigned band);
+int64_t sim_time(struct smr_sim *s, struct sim_stats *st);
+void sim_print(struct smr_sim *s);
+
+#endif
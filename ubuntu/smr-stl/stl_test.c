@@ -8,11 +8,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
  
 #include "stl.h"
 #include "stl_map.h"
 #include "stl_base.h"
 #include "stl_public.h"
+#include "stl_rcache.h"
+#include "stl_crc.h"
+#include "stl_fakesmr.h"
 
 void print_metadata(struct volume *v)
 {
@@ -29,7 +33,96 @@ void print_metadata(struct volume *v)
         i = j+1;
     }
 
-    struct entry *e = stl_map_lba_iterate(v->map, NULL);
+    /* per-band live counters, checked against a scan of the map
+     */
+    int *sectors = calloc(v->n_bands, sizeof(int));
+    int *extents = calloc(v->n_bands, sizeof(int));
+    struct entry *e;
+    for (e = stl_map_pba_iterate(v->map, NULL); e != NULL;
+         e = stl_map_pba_iterate(v->map, e))
+        if (e->pba.band > 0) {
+            sectors[e->pba.band] += e->len;
+            extents[e->pba.band]++;
+        }
+    printf("live:\n");
+    for (i = 1 + v->map_size; i < v->n_bands; i++) {
+        struct band *b = &v->band[i];
+        if (b->live_sectors == 0 && sectors[i] == 0)
+            continue;
+        printf("%d %d sectors %d extents bucket %d", i, b->live_sectors,
+               b->live_extents, b->bucket);
+        if (b->live_sectors != sectors[i] || b->live_extents != extents[i])
+            printf(" MISMATCH %d %d", sectors[i], extents[i]);
+        printf("\n");
+    }
+    free(sectors);
+    free(extents);
+
+    int live, peak, chunks;
+    stl_map_alloc_stats(v->map, &live, &peak, &chunks);
+    printf("map: %d entries (%d peak) in %d chunks\n", live, peak, chunks);
+    printf("checkpoint: %d dirty + %d clean entries, %d dirty bands%s\n",
+           v->dirty.n, v->clean.n, v->n_dirty_bands,
+           v->dirty.n + v->clean.n != stl_map_count(v->map) ? " MISMATCH" : "");
+    printf("checkpoints: %lld, %lld records in %lld bytes (%.1f per record), "
+           "%lld sectors\n", (long long)v->ck.checkpoints,
+           (long long)v->ck.records, (long long)v->ck.bytes,
+           v->ck.records ? (double)v->ck.bytes / v->ck.records : 0.0,
+           (long long)v->ck.sectors);
+
+    struct mount_stats *ms = &v->mount;
+    printf("mount: %lld us (heads %lld, tail %lld, records %lld, chase %lld, "
+           "checkpoint %lld), %lld reads of %lld sectors, %d rolled forward\n",
+           (long long)ms->total_usecs, (long long)ms->heads_usecs,
+           (long long)ms->tail_usecs, (long long)ms->records_usecs,
+           (long long)ms->chase_usecs, (long long)ms->ck_usecs,
+           (long long)ms->reads, (long long)ms->sectors, ms->rolled);
+
+    struct clean_stats *st = &v->stats;
+    printf("cleaning: %lld bg, %lld stalls, %lld fg (%lld us, max %lld), "
+           "%lld waits (%lld us, max %lld)\n",
+           (long long)st->n_bg_cleans, (long long)st->n_stalls,
+           (long long)st->n_fg_cleans,
+           (long long)st->fg_usecs, (long long)st->max_fg_usecs,
+           (long long)st->n_waits, (long long)st->wait_usecs,
+           (long long)st->max_wait_usecs);
+
+    printf("reads: %lld host, %lld physical (%.2f per host read)\n",
+           (long long)v->reads.host_reads, (long long)v->reads.phys_reads,
+           v->reads.host_reads ? (double)v->reads.phys_reads / v->reads.host_reads : 0.0);
+
+    if (v->wcache_sectors > 0)
+        printf("wcache: %lld written, %lld absorbed, %lld read hits, "
+               "%lld drained in %lld extents\n",
+               (long long)v->wc.writes, (long long)v->wc.absorbed,
+               (long long)v->wc.read_hits, (long long)v->wc.drained,
+               (long long)v->wc.extents);
+
+    if (v->rcache != NULL) {
+        struct rc_stats *s = &v->rcache->stats;
+        printf("rcache: %lld lookups, %lld hits (%.1f%%), %lld sectors hit, "
+               "%lld filled, %lld evicted, %lld invalidated\n",
+               (long long)s->lookups, (long long)s->hits,
+               s->lookups ? 100.0 * s->hits / s->lookups : 0.0,
+               (long long)s->hit_sectors, (long long)s->fill_sectors,
+               (long long)s->evictions, (long long)s->invalidations);
+    }
+
+    for (i = 0; i < N_POLICIES; i++) {
+        struct wamp_stats *w = &v->wamp;
+        int64_t host = w->data_sectors[i] - w->moved_sectors[i];
+        if (w->disk_sectors[i] == 0)
+            continue;
+        printf("policy %s%s: host %lld moved %lld written %lld WA %.3f\n",
+               volume_policy_name(i), i == v->policy ? " (current)" : "",
+               (long long)host, (long long)w->moved_sectors[i],
+               (long long)w->disk_sectors[i],
+               host > 0 ? (double)w->disk_sectors[i] / host : 0.0);
+    }
+
+    smr_sim_print(v->disk);
+
+    e = stl_map_lba_iterate(v->map, NULL);
     while (e != NULL) {
         printf("%d +%d -> %d.%d at %d.%d (%d%s)\n", (int)e->lba, e->len,
                e->pba.band, e->pba.offset, e->location.band, e->location.offset,
@@ -50,6 +143,91 @@ void cmd_checkpoint(struct volume *v, int argc, char **argv)
     checkpoint_volume(v);
 }
 
+static int64_t usecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* ckbench <entries> <dirty> [rounds] - checkpoint latency vs. map
+ * size. Writes every other sector until the map has <entries>
+ * extents, then rewrites <dirty> random ones and times a checkpoint,
+ * <rounds> times.
+ */
+void cmd_ckbench(struct volume *v, int argc, char **argv)
+{
+    int i, r, n = atoi(argv[1]), dirty = atoi(argv[2]);
+    int rounds = (argc > 3) ? atoi(argv[3]) : 10;
+    int64_t t, total = 0, worst = 0;
+
+    if (n > volume_size(v) / SECTOR_SIZE / 2)
+        n = volume_size(v) / SECTOR_SIZE / 2;
+    memset(cmdline_buf, 1, SECTOR_SIZE);
+    for (i = 0; i < n; i++)
+        host_write(v, 2*i, cmdline_buf, SECTOR_SIZE);
+    checkpoint_volume(v);
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < dirty; i++)
+            host_write(v, 2*(random() % n), cmdline_buf, SECTOR_SIZE);
+        t = usecs();
+        checkpoint_volume(v);
+        t = usecs() - t;
+        total += t;
+        if (t > worst)
+            worst = t;
+    }
+    fprintf(stderr, "ckbench: %d entries, %d dirty: %lld us/checkpoint "
+            "(max %lld)\n", stl_map_count(v->map), dirty,
+            (long long)(total / rounds), (long long)worst);
+}
+
+/* crcbench [n] - cost of the header checksums. Times n checksums of a
+ * data packet trailer with one map record, with the CPU's crc32
+ * instruction (if any) and the table, then n single-sector writes;
+ * each write seals two headers.
+ */
+volatile uint32_t sink;
+void cmd_crcbench(struct volume *v, int argc, char **argv)
+{
+    int i, n = (argc > 1) ? atoi(argv[1]) : 100000;
+    int64_t t, hw, sw, wr;
+    struct header *h = cmdline_buf;
+
+    memset(cmdline_buf, 0, 2 * SECTOR_SIZE);
+    *h = (struct header){.magic = STL_MAGIC, .seq = 1, .type = RECORD_DATA,
+                         .local_records = 1};
+    int len = hdr_len(h);
+
+    t = usecs();
+    for (i = 0; i < n; i++)
+        sink = crc32c(i, h, len);
+    hw = usecs() - t;
+    t = usecs();
+    for (i = 0; i < n; i++)
+        sink = crc32c_sw(i, h, len);
+    sw = usecs() - t;
+    t = usecs();
+    for (i = 0; i < n / 100; i++)
+        sink = crc32c(i, cmdline_buf, 2 * SECTOR_SIZE);
+    int64_t bulk = usecs() - t;
+
+    memset(cmdline_buf, 1, SECTOR_SIZE);
+    t = usecs();
+    for (i = 0; i < n; i++)
+        host_write(v, 2*(i % (volume_size(v) / SECTOR_SIZE / 2)),
+                   cmdline_buf, SECTOR_SIZE);
+    wr = usecs() - t;
+
+    fprintf(stderr, "crcbench: %d-byte header %.1f ns (%s), %.1f ns (table); "
+            "%.0f MB/s on 8KB; write %.2f us, checksums %.3f%% (table "
+            "%.3f%%)\n", len, 1000.0 * hw / n,
+            crc32c_hw() ? "sse4.2" : "table", 1000.0 * sw / n,
+            bulk ? 2.0 * SECTOR_SIZE * (n / 100) / bulk : 0, (double)wr / n,
+            wr ? 100.0 * 2 * hw / wr : 0, wr ? 100.0 * 2 * sw / wr : 0);
+}
+
 void cmd_print(struct volume *v, int argc, char **argv)
 {
     print_metadata(v);
@@ -163,6 +341,77 @@ void cmd_break(struct volume *v, int argc, char **argv)
 {
 }
 
+/* batch <KB> <usecs> - group commit on (KB > 0) or off
+ */
+void cmd_batch(struct volume *v, int argc, char **argv)
+{
+    int kb = atoi(argv[1]), usecs = (argc > 2) ? atoi(argv[2]) : 1000;
+    volume_batching(v, kb, usecs);
+}
+
+void cmd_flush(struct volume *v, int argc, char **argv)
+{
+    host_flush(v);
+}
+
+/* policy <greedy|cost-benefit|seeks> - cleaning victim selection
+ */
+void cmd_policy(struct volume *v, int argc, char **argv)
+{
+    if (argc < 2 || volume_policy(v, argv[1]) < 0)
+        printf("unknown policy\n");
+}
+
+/* frontiers <1..3> - separate write frontiers for cleaned data
+ */
+void cmd_frontiers(struct volume *v, int argc, char **argv)
+{
+    volume_frontiers(v, atoi(argv[1]));
+}
+
+/* sequential <KB> - sequential stream detection threshold, 0 = off
+ */
+void cmd_sequential(struct volume *v, int argc, char **argv)
+{
+    volume_sequential(v, atoi(argv[1]));
+}
+
+/* wcache <MB> - write-back staging cache, 0 = off
+ */
+void cmd_wcache(struct volume *v, int argc, char **argv)
+{
+    volume_wcache(v, atoi(argv[1]));
+}
+
+/* rcache <MB> - extent read cache, 0 = off
+ */
+void cmd_rcache(struct volume *v, int argc, char **argv)
+{
+    volume_rcache(v, atoi(argv[1]));
+}
+
+/* ckinterval <n> - sequence numbers between checkpoints
+ */
+void cmd_ckinterval(struct volume *v, int argc, char **argv)
+{
+    volume_checkpoint_interval(v, atoi(argv[1]));
+}
+
+/* sim [key=value,...] - model drive timing from here on
+ */
+void cmd_sim(struct volume *v, int argc, char **argv)
+{
+    if (volume_sim(v, argc > 1 ? argv[1] : "") < 0)
+        printf("bad sim parameters\n");
+}
+
+/* cleaner <0|1> - background cleaning thread off/on
+ */
+void cmd_cleaner(struct volume *v, int argc, char **argv)
+{
+    volume_cleaner(v, atoi(argv[1]));
+}
+
 void cmd_trim(struct volume *v, int argc, char **argv)
 {
     int lba = atoi(argv[1]), len = atoi(argv[2]);
@@ -175,6 +424,8 @@ struct {
 } cmdtable[] = {
     {.cmd = "clean", .fn=cmd_clean},
     {.cmd = "checkpoint", .fn=cmd_checkpoint},
+    {.cmd = "ckbench", .fn=cmd_ckbench},
+    {.cmd = "crcbench", .fn=cmd_crcbench},
     {.cmd = "print", .fn=cmd_print},
     {.cmd = "rprint", .fn=cmd_rprint},
     {.cmd = "fprint", .fn=cmd_fprint},
@@ -183,6 +434,16 @@ struct {
     {.cmd = "write", .fn=cmd_write},
     {.cmd = "break", .fn=cmd_break},
     {.cmd = "trim", .fn=cmd_trim},
+    {.cmd = "batch", .fn=cmd_batch},
+    {.cmd = "flush", .fn=cmd_flush},
+    {.cmd = "cleaner", .fn=cmd_cleaner},
+    {.cmd = "policy", .fn=cmd_policy},
+    {.cmd = "frontiers", .fn=cmd_frontiers},
+    {.cmd = "sequential", .fn=cmd_sequential},
+    {.cmd = "wcache", .fn=cmd_wcache},
+    {.cmd = "rcache", .fn=cmd_rcache},
+    {.cmd = "ckinterval", .fn=cmd_ckinterval},
+    {.cmd = "sim", .fn=cmd_sim},
     {.cmd = "overlap", .fn=cmd_overlap}
 };
 
@@ -191,16 +452,21 @@ void verify_free(struct volume *v)
     int g, i, nf;
     for (g = 0; g < v->n_groups; g++) {
         int base = 1 + v->map_size + v->group_size * g;
+        pthread_mutex_lock(&v->groups[g].lock); /* cleaner may be running */
         for (i = nf = 0; i < v->group_size; i++)
             if (v->band[base+i].type == BAND_TYPE_FREE)
                 nf++;
         assert(nf == v->groups[g].count[BAND_TYPE_FREE]);
+        pthread_mutex_unlock(&v->groups[g].lock);
     }
 }
 
+/* usage: stl <device> [uring]
+ */
 int main(int argc, char **argv)
 {
-    struct volume *v = init_volume(argv[1]);
+    int flags = (argc > 2 && !strcmp(argv[2], "uring")) ? STL_URING : 0;
+    struct volume *v = init_volume_flags(argv[1], flags);
     print_metadata(v);
 
     char line[80];
@@ -220,10 +486,12 @@ int main(int argc, char **argv)
             continue;
         if (!strcmp(av[0], "quit"))
             break;
-        if (!strcmp(av[0], "close"))
+        if (!strcmp(av[0], "close")) {
             delete_volume(v);
+            v = NULL;
+        }
         else if (!strcmp(av[0], "open"))
-            v = init_volume(argv[1]);
+            v = init_volume_flags(argv[1], flags);
         else {
             for (i = 0; i < n_cmds; i++) 
                 if (!strcmp(av[0], cmdtable[i].cmd)) {
@@ -233,7 +501,8 @@ int main(int argc, char **argv)
             if (i == n_cmds)
                 printf("invalid command: %s\n", av[0]);
         }
-        verify_free(v);
+        if (v != NULL)
+            verify_free(v);
     }
     printf("verification errors: %d\n", bad);
     return 0;
@@ -0,0 +1,149 @@
+/*
+ * file:        stl_zbd.c
+ * description: zone report and reset for Linux zoned block devices
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/blkzoned.h>
+
+#include "stl_zbd.h"
+
+#define SECTOR_SIZE 4096
+#define SECTOR_512  (SECTOR_SIZE/512)    /* ioctls count 512-byte sectors */
+
+/* zones per BLKREPORTZONE - 4096 descriptors is 256KB, so a 20TB
+ * drive with 256MB zones takes a handful of calls
+ */
+#define ZBD_REPORT_ZONES 4096
+
+/* zone length in 4K sectors, or 0 if 'fd' isn't a zoned block device
+ */
+int zbd_probe(int fd)
+{
+    struct stat sb;
+    __u32 zone_size = 0;
+    if (fstat(fd, &sb) < 0 || !S_ISBLK(sb.st_mode))
+        return 0;
+    if (ioctl(fd, BLKGETZONESZ, &zone_size) < 0)
+        return 0;
+    return zone_size / SECTOR_512;
+}
+
+/* sequential and writable
+ */
+static int zone_usable(struct blk_zone *zone)
+{
+    return (zone->type == BLK_ZONE_TYPE_SEQWRITE_REQ ||
+            zone->type == BLK_ZONE_TYPE_SEQWRITE_PREF) &&
+        zone->cond != BLK_ZONE_COND_READONLY &&
+        zone->cond != BLK_ZONE_COND_OFFLINE;
+}
+
+/* find the bands and their write pointers from a report of every
+ * zone on the device. Returns 0, or -1 if the device has no usable
+ * zones; '*write_pointers' is malloc'ed.
+ */
+int zbd_open(int fd, struct zbd_info *z, int **write_pointers)
+{
+    __u32 nr_zones;
+    int zone_len = zbd_probe(fd);
+    if (zone_len == 0 || ioctl(fd, BLKGETNRZONES, &nr_zones) < 0)
+        return -1;
+    if (nr_zones == 0)
+        return -1;
+
+    *z = (struct zbd_info){.n_zones = nr_zones, .zone_len = zone_len,
+                           .first = -1};
+    int *wp = malloc(nr_zones * sizeof(int));
+    struct blk_zone_report *rep =
+        malloc(sizeof(*rep) + ZBD_REPORT_ZONES * sizeof(struct blk_zone));
+    __u64 sector = 0;
+    int i, n = 0, done = 0;
+
+    while (n < nr_zones) {
+        rep->sector = sector;
+        rep->nr_zones = ZBD_REPORT_ZONES;
+        if (ioctl(fd, BLKREPORTZONE, rep) < 0) {
+            perror("BLKREPORTZONE");
+            goto fail;
+        }
+        if (rep->nr_zones == 0)
+            break;
+
+        for (i = 0; i < rep->nr_zones; i++, n++) {
+            struct blk_zone *zone = &rep->zones[i];
+            __u64 cap = zone->len;
+            if (rep->flags & BLK_ZONE_REP_CAPACITY)     /* ZNS, 5.9 on */
+                cap = zone->capacity;
+            /* a smaller last zone ends the bands too */
+            if (!zone_usable(zone) || zone->len != zone_len * SECTOR_512 ||
+                done) {
+                z->n_skipped++;
+                if (z->first >= 0)
+                    done = 1;
+                continue;
+            }
+            if (z->first < 0)
+                z->first = n;
+            if (cap % SECTOR_512 || zone->start != (__u64)n * zone->len) {
+                printf("zbd: zone %d: start %llu len %llu capacity %llu"
+                       " not supported\n", n, (unsigned long long)zone->start,
+                       (unsigned long long)zone->len, (unsigned long long)cap);
+                goto fail;
+            }
+            if (z->band_size == 0 || cap / SECTOR_512 < z->band_size)
+                z->band_size = cap / SECTOR_512;
+
+            /* a write pointer that isn't on a 4K boundary (something
+             * else wrote here) can't be written at, so call it full
+             */
+            __u64 used = zone->wp - zone->start;
+            if (zone->cond == BLK_ZONE_COND_EMPTY)
+                wp[z->n_bands] = 0;
+            else if (zone->cond == BLK_ZONE_COND_FULL || used >= cap ||
+                     used % SECTOR_512 != 0)
+                wp[z->n_bands] = cap / SECTOR_512;
+            else
+                wp[z->n_bands] = used / SECTOR_512;
+            z->n_bands++;
+        }
+        struct blk_zone *last = &rep->zones[rep->nr_zones - 1];
+        sector = last->start + last->len;
+    }
+    free(rep);
+
+    if (z->n_bands == 0) {
+        printf("zbd: no sequential zones\n");
+        free(wp);
+        return -1;
+    }
+    for (i = 0; i < z->n_bands; i++)
+        if (wp[i] > z->band_size)
+            wp[i] = z->band_size;
+    *write_pointers = wp;
+    return 0;
+
+fail:
+    free(rep);
+    free(wp);
+    return -1;
+}
+
+/* reset the write pointers of 'n' bands from 'band' with a single
+ * BLKRESETZONE - the kernel turns the whole device into one reset-all
+ */
+int zbd_reset(int fd, struct zbd_info *z, unsigned band, unsigned n)
+{
+    struct blk_zone_range range = {
+        .sector = (__u64)(z->first + band) * z->zone_len * SECTOR_512,
+        .nr_sectors = (__u64)n * z->zone_len * SECTOR_512};
+    if (ioctl(fd, BLKRESETZONE, &range) < 0) {
+        perror("BLKRESETZONE");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * file:        stl_zbd.h
+ * description: Linux zoned block devices (host-managed SMR, ZNS,
+ *              null_blk / scsi_debug) as the SMR device
+ */
+#ifndef __STL_ZBD_H__
+#define __STL_ZBD_H__
+
+/* Band N is the N'th sequential zone from the first one on the
+ * device, so the conventional zones host-managed drives keep at the
+ * start are skipped. The bands end at the next zone that isn't
+ * sequential and writable. Sizes are in 4K sectors; band_size is the
+ * smallest zone capacity, which is less than zone_len on ZNS.
+ */
+struct zbd_info {
+    int n_zones;                /* on the device */
+    int zone_len;               /* distance between zone starts */
+    int first;                  /* zone number of band 0 */
+    int n_bands;
+    int band_size;
+    int n_skipped;              /* zones not used as bands */
+};
+
+int zbd_probe(int fd);
+int zbd_open(int fd, struct zbd_info *z, int **write_pointers);
+int zbd_reset(int fd, struct zbd_info *z, unsigned band, unsigned n);
+
+#endif
@@ -0,0 +1,37 @@
+# stl_test script: TRIMs longer than a band have to survive a
+# checkpoint and a reopen. For bands of 256 sectors (1MB) or less:
+#   ./mkfakesmr --bandsize=1m image.img
+#   ./format --group-bands=40 --map-bands=8 --over-provisioning=1.3 image.img
+#   ./stl image.img < trim-reopen.cmd
+# it should finish with no bad values reported
+write 0 600 5
+trim 10 500
+# a run of TRIMs is merged into one entry longer than a band
+write 1000 1200 6
+trim 1000 200
+trim 1200 200
+trim 1400 200
+trim 1600 300
+flush
+checkpoint
+close
+open
+verify 0 10 5
+verify 10 500 0
+verify 510 90 5
+verify 1000 900 0
+verify 1900 300 6
+# and again after writes into the middle of the trimmed ranges
+write 100 50 7
+write 1500 20 8
+flush
+checkpoint
+close
+open
+verify 10 90 0
+verify 100 50 7
+verify 150 360 0
+verify 1000 500 0
+verify 1500 20 8
+verify 1520 380 0
+verify 1900 300 6